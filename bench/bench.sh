@@ -0,0 +1,104 @@
+#!/bin/bash
+#
+# bench.sh - Boot the module in QEMU (aarch64, Linux 4.9) with an i2c-stub PMIC at 0x34,
+# run N dry-run shutdown cycles against a vfat /mnt/SDCARD and report per-stage timings
+#
+# Usage: bench/bench.sh [cycles]    (run from the repository root, or via 'make bench')
+#        bench/bench.sh faults      (one real shutdown per injected fault, 'make bench-faults';
+#                                    fails unless every cutoff starts within the budget)
+#
+
+set -e
+
+MODE="cycles"
+CYCLES="${1:-20}"
+if [ "$1" = "faults" ]; then
+    MODE="faults"
+    CYCLES=0
+fi
+
+# Faults run with the module defaults: budget, plus the watchdog's own sync and the PMIC writes
+SHUTDOWN_BUDGET_MS=20000
+CUTOFF_LIMIT_MS=$((SHUTDOWN_BUDGET_MS + 1000 + 500))
+FAULTS="none i2c umount_busy stall_sync stall_umount sigterm_ignore combined"
+DOCKER_IMAGE="${DOCKER_IMAGE:-trimui-brick-gcc74}"
+KERNEL_TARBALL="kernel-headers/linux-4.9.tar.xz"
+BUSYBOX_VERSION="1.36.1"
+WORK="bench/work"
+
+if ! command -v qemu-system-aarch64 >/dev/null 2>&1; then
+    echo "Error: qemu-system-aarch64 not found"
+    echo "  macOS: brew install qemu"
+    echo "  Linux: apt-get install qemu-system-arm"
+    exit 1
+fi
+
+if [ ! -f "$KERNEL_TARBALL" ]; then
+    echo "Error: $KERNEL_TARBALL not found"
+    echo "Run 'make setup-headers' first"
+    exit 1
+fi
+
+mkdir -p "$WORK"
+
+# Busybox is fetched on the host; the Docker image has no downloader
+if [ ! -d "$WORK/busybox-${BUSYBOX_VERSION}" ]; then
+    echo "Downloading busybox ${BUSYBOX_VERSION}..."
+    curl -L -o "$WORK/busybox-${BUSYBOX_VERSION}.tar.bz2" \
+        "https://busybox.net/downloads/busybox-${BUSYBOX_VERSION}.tar.bz2"
+    tar -C "$WORK" -xjf "$WORK/busybox-${BUSYBOX_VERSION}.tar.bz2"
+fi
+
+echo "Building bench kernel, busybox and module..."
+docker run --rm \
+    -v "$(pwd):/work" \
+    -w /work \
+    -e BUSYBOX_VERSION="$BUSYBOX_VERSION" \
+    "$DOCKER_IMAGE" \
+    bash -c "source /root/setup-env.sh && bench/build.sh"
+
+# Boot the guest once; the blank card image is formatted vfat by the guest
+run_qemu() {
+    local append="$1" log="$2"
+
+    rm -f "$WORK/sdcard.img"
+    dd if=/dev/zero of="$WORK/sdcard.img" bs=1M count=64 2>/dev/null
+    timeout $((CYCLES * 30 + 120)) qemu-system-aarch64 \
+        -M virt -cpu cortex-a53 -smp 4 -m 512 \
+        -nographic -no-reboot \
+        -kernel "$WORK/Image" \
+        -append "console=ttyAMA0 loglevel=4 $append" \
+        -drive file="$WORK/sdcard.img",if=virtio,format=raw \
+        | tee "$log" || true
+}
+
+if [ "$MODE" = "cycles" ]; then
+    echo "Booting QEMU for $CYCLES shutdown cycles..."
+    run_qemu "bench_cycles=$CYCLES" "$WORK/console.log"
+    echo ""
+    awk -f bench/stats.awk "$WORK/console.log"
+    exit 0
+fi
+
+failed=0
+results=""
+for fault in $FAULTS; do
+    echo "Booting QEMU with fault: $fault"
+    run_qemu "bench_fault=$fault" "$WORK/fault-$fault.log"
+    set -- $(awk -f bench/faults.awk "$WORK/fault-$fault.log")
+    if [ "$1" = "NO_CUTOFF" ]; then
+        verdict="FAIL (no cutoff)"
+        failed=1
+    elif [ "$1" -gt "$CUTOFF_LIMIT_MS" ]; then
+        verdict="FAIL"
+        failed=1
+    else
+        verdict="ok"
+    fi
+    results="$results$(printf '%-16s %8s ms  deadline=%s  %s' "$fault" "$1" "${2:--}" "$verdict")\n"
+done
+
+echo ""
+echo "Time from signal to PMIC trigger (limit ${CUTOFF_LIMIT_MS}ms):"
+printf "$results"
+exit $failed
@@ -0,0 +1,58 @@
+#!/bin/bash
+#
+# build.sh - Build the QEMU bench kernel (virt, i2c-stub, vfat), a static busybox rootfs
+# and the module against that kernel. Runs inside the Docker image, called by bench.sh.
+#
+
+set -e
+
+WORK="/work/bench/work"
+KERNEL_DIR="$WORK/linux-4.9"
+BUSYBOX_DIR="$WORK/busybox-${BUSYBOX_VERSION}"
+ROOTFS="$WORK/rootfs"
+JOBS=$(nproc)
+
+# A pristine tree: the one under kernel-headers/ is configured for the device
+if [ ! -d "$KERNEL_DIR" ]; then
+    echo "Extracting bench kernel source..."
+    tar -C "$WORK" -xf /work/kernel-headers/linux-4.9.tar.xz
+fi
+
+mkdir -p "$ROOTFS"
+
+cd "$KERNEL_DIR"
+if [ ! -f .config ]; then
+    make defconfig
+    scripts/kconfig/merge_config.sh -m .config /work/bench/kernel.config
+    make olddefconfig
+fi
+make -j"$JOBS" Image modules
+
+cd "$BUSYBOX_DIR"
+if [ ! -f .config ]; then
+    make defconfig
+    sed -i 's/^# CONFIG_STATIC is not set/CONFIG_STATIC=y/' .config
+    sed -i 's/^CONFIG_TC=y/# CONFIG_TC is not set/' .config
+fi
+make -j"$JOBS"
+
+# Build the module out of a copy so the device build in src/ is left alone
+mkdir -p "$WORK/module"
+cp /work/src/poweroff_hook.c /work/src/Kbuild "$WORK/module/"
+make -C "$KERNEL_DIR" M="$WORK/module" modules
+
+echo "Assembling rootfs..."
+rm -rf "$ROOTFS"
+mkdir -p "$ROOTFS"/{proc,sys,dev,tmp,root,mnt/SDCARD,lib/modules,usr/sbin}
+make -C "$BUSYBOX_DIR" CONFIG_PREFIX="$ROOTFS" install >/dev/null
+# Helper paths the module calls that busybox installs elsewhere
+ln -sf ../../bin/busybox "$ROOTFS/usr/sbin/swapoff"
+cp "$KERNEL_DIR/drivers/i2c/i2c-stub.ko" "$WORK/module/poweroff_hook.ko" "$ROOTFS/lib/modules/"
+cp /work/bench/init "$ROOTFS/init"
+chmod +x "$ROOTFS/init"
+
+# Relink with the rootfs as built-in initramfs
+cd "$KERNEL_DIR"
+make -j"$JOBS" Image
+cp arch/arm64/boot/Image "$WORK/Image"
+echo "Bench image ready: bench/work/Image"
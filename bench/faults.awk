@@ -0,0 +1,28 @@
+#
+# faults.awk - Time from the shutdown signal to the PMIC trigger write in one fault run
+#
+# Prints "<ms> <deadline>" where deadline is 1 if the watchdog had to take over,
+# or NO_CUTOFF if the trigger was never reached. Relies on printk timestamps.
+#
+
+function ts(line,    s) {
+    if (!match(line, /\[ *[0-9]+\.[0-9]+\]/))
+        return 0
+    s = substr(line, RSTART + 1, RLENGTH - 2)
+    gsub(/ /, "", s)
+    return s + 0
+}
+
+{ sub(/\r$/, "") }
+
+/DEBUG MARKER: SIGNAL_DETECTED/ && !t0 { t0 = ts($0) }
+/DEBUG MARKER: STEP4_TRIGGER_POWEROFF/ && !t1 { t1 = ts($0) }
+/DEBUG MARKER: DEADLINE_EXPIRED/ { deadline = 1 }
+
+END {
+    if (!t0 || !t1) {
+        print "NO_CUTOFF"
+        exit
+    }
+    printf "%d %d\n", (t1 - t0) * 1000, deadline
+}
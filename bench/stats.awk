@@ -0,0 +1,73 @@
+#
+# stats.awk - Per-stage shutdown timing percentiles from a bench console log
+#
+# Reads BENCH_STAGE <stage> <outcome> <ms> and BENCH_TOTAL <ms> lines written by
+# bench/init after each dry-run cycle, plus the STAGE_EXIT marker of the final real
+# run (the only source for pmic_cutoff). Skipped stages are not counted.
+#
+
+function sort_values(arr, n,    i, j, v) {
+    for (i = 2; i <= n; i++) {
+        v = arr[i]
+        for (j = i - 1; j >= 1 && arr[j] > v; j--)
+            arr[j + 1] = arr[j]
+        arr[j + 1] = v
+    }
+}
+
+# Nearest-rank percentile over sorted values
+function pct(arr, n, p,    r) {
+    r = int((p * n + 99) / 100)
+    if (r < 1)
+        r = 1
+    return arr[r]
+}
+
+function add(stage, ms) {
+    if (!(stage in count)) {
+        order[++nstages] = stage
+        count[stage] = 0
+    }
+    count[stage]++
+    samples[stage, count[stage]] = ms + 0
+}
+
+{ sub(/\r$/, "") }
+
+$1 == "BENCH_STAGE" && $3 != "skipped" && $3 != "pending" {
+    add($2, $4)
+    if ($3 != "ok")
+        bad[$2]++
+}
+
+$1 == "BENCH_TOTAL" {
+    add("TOTAL", $2)
+}
+
+/DEBUG MARKER: STAGE_EXIT pmic_cutoff/ {
+    for (i = 1; i <= NF; i++)
+        if ($i ~ /^time=/) {
+            v = $i
+            sub(/^time=/, "", v)
+            sub(/ms$/, "", v)
+            add("pmic_cutoff", v)
+        }
+}
+
+END {
+    if (nstages == 0) {
+        print "No bench samples found (see bench/work/console.log)"
+        exit 1
+    }
+    printf "%-18s %5s %8s %8s %8s %8s %s\n", "stage", "n", "p50", "p95", "p99", "max", "not-ok"
+    for (s = 1; s <= nstages; s++) {
+        name = order[s]
+        n = count[name]
+        delete vals
+        for (i = 1; i <= n; i++)
+            vals[i] = samples[name, i]
+        sort_values(vals, n)
+        printf "%-18s %5d %6dms %6dms %6dms %6dms %d\n", name, n,
+               pct(vals, n, 50), pct(vals, n, 95), pct(vals, n, 99), vals[n], bad[name] + 0
+    }
+}
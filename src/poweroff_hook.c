@@ -10,8 +10,9 @@
  * 1. NextUI creates /tmp/poweroff signal file
  * 2. Module detects signal and begins shutdown sequence
  * 3. Kill all user processes that use the SD card 
- * 4. Unmount filesystems (swapoff, umount /etc/profile, umount /mnt/SDCARD)
- * 5. Verify SD card unmount status
+ * 4. Unmount filesystems (swapoff of card-backed swap only, umount /etc/profile, mounts stacked on the card
+ *    deepest first incl. SD-backed loop devices, then umount /mnt/SDCARD)
+ * 5. Verify SD card unmount status, flush the card's block device
  * 6. Kill all user processes (SIGTERM then SIGKILL)
  * 7. Execute AXP717/AXP2202 PMIC shutdown sequence (safe minimal version)
  * 8. Call kernel poweroff (standard shutdown)
@@ -22,6 +23,11 @@
  * Step 3: Configure shutdown sources (0x22 = 0x0A, bits 1 and 3 only)
  * Step 4: Trigger software poweroff (0x27 = 0x01)
  *
+ * The sequence lives in a per-PMIC table (pmic_variants[]) selected at load
+ * from the device tree node at the PMIC address; supporting another PMIC
+ * means adding a table entry, not editing execute_axp2202_poweroff(). With
+ * no match the cutoff is disabled rather than writing 0x27 to an unknown chip.
+ *
  * IMPORTANT NOTES:
  * - IRQ enable registers: 0x40-0x44
  * - IRQ status registers: 0x48-0x4C
@@ -43,6 +49,11 @@
 #include <linux/time.h>
 #include <linux/delay.h>
 #include <linux/i2c.h>
+#include <linux/regmap.h>
+#include <linux/of.h>
+#include <linux/of_address.h>
+#include <linux/io.h>
+#include <linux/pm.h>
 #include <linux/mount.h>
 #include <linux/path.h>
 #include <linux/namei.h>
@@ -51,6 +62,33 @@
 #include <linux/swap.h>
 #include <linux/syscalls.h>
 #include <linux/kmod.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/fdtable.h>
+#include <linux/fs_struct.h>
+#include <linux/mm.h>
+#include <linux/rcupdate.h>
+#include <linux/ktime.h>
+#include <linux/blkdev.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/pid.h>
+#include <linux/hrtimer.h>
+#include <linux/atomic.h>
+#include <linux/power_supply.h>
+#include <linux/thermal.h>
+#include <linux/backlight.h>
+#include <linux/fb.h>
+#include <linux/notifier.h>
+#include <linux/kdebug.h>
+#include <linux/kmsg_dump.h>
+#include <linux/wait.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/async.h>
+#include <linux/cpufreq.h>
+#include <linux/cpu.h>
+#include <linux/sort.h>
 #include <generated/utsrelease.h>
 
 MODULE_LICENSE("GPL");
@@ -62,15 +100,106 @@ MODULE_VERSION("1.0");
 #define I2C_BUS_NUMBER 6
 #define AXP2202_I2C_ADDR 0x34
 
+/* Most registers written in one combined I2C transfer */
+#define AXP2202_MAX_BATCH 8
+
+/* Bus-level retries per PMIC transfer, and write+readback attempts for verified registers */
+#define PMIC_I2C_RETRIES 3
+#define PMIC_VERIFY_RETRIES 3
+
+/* Allwinner TWI (mv64xxx-style) registers, for the polled atomic-context path */
+#define TWI_DATA 0x08
+#define TWI_CNTR 0x0C
+#define TWI_STAT 0x10
+#define TWI_CCR 0x14
+#define TWI_SRST 0x18
+#define TWI_DRV_CTRL 0x200
+
+#define TWI_CNTR_ACK BIT(2)
+#define TWI_CNTR_IFLG BIT(3)    /* write 1 to clear on sun6i and later */
+#define TWI_CNTR_STP BIT(4)
+#define TWI_CNTR_STA BIT(5)
+#define TWI_CNTR_BUS_EN BIT(6)
+
+#define TWI_STAT_START 0x08
+#define TWI_STAT_RSTART 0x10
+#define TWI_STAT_ADDR_W_ACK 0x18
+#define TWI_STAT_DATA_W_ACK 0x28
+#define TWI_STAT_ADDR_R_ACK 0x40
+#define TWI_STAT_DATA_R_NACK 0x58
+
+/* Per-byte poll budget for the polled path (a byte at 100kHz takes ~90us) */
+#define TWI_POLL_TIMEOUT_US 2000
+
+/* IC type register, logged at load (X-Powers family) */
+#define PMIC_CHIP_ID_REG 0x03
+
 /* Signal file that NextUI creates */
 #define POWEROFF_SIGNAL_FILE "/tmp/poweroff"
 
+/* SD card mountpoint and the mount table it is resolved against (init's namespace) */
+#define SDCARD_PATH "/mnt/SDCARD"
+#define MOUNTINFO_PATH "/proc/1/mountinfo"
+#define MOUNTINFO_BUF_SIZE (32 * 1024)
+#define MAX_MOUNTS 64
+#define MOUNT_PATH_LEN 256
+#define MAX_LOOP_DEVICES 16
+
+/* Limits for the "what pins the card" report */
+#define MAX_SCAN_TASKS 1024
+#define MAX_BLOCKERS 32
+#define MAX_STACK_LINES 16
+
+/* Upper bound on active swap areas considered at shutdown */
+#define MAX_SWAP_AREAS 8
+
 /* Log path (will only work before SD card unmount) */
 #define LOG_PATH "/mnt/SDCARD/.userdata/tg5040/logs/PowerOffHook-KernelModule.txt"
 
+/* PMIC location, overridable for other board revisions */
+static int i2c_bus = I2C_BUS_NUMBER;
+module_param(i2c_bus, int, 0444);
+MODULE_PARM_DESC(i2c_bus, "I2C bus of the PMIC (default 6)");
+
+static ushort pmic_addr = AXP2202_I2C_ADDR;
+module_param(pmic_addr, ushort, 0444);
+MODULE_PARM_DESC(pmic_addr, "I2C address of the PMIC (default 0x34)");
+
 /* Global I2C adapter for AXP717/AXP2202 communication */
 static struct i2c_adapter *i2c_adapter = NULL;
 
+/* Install the atomic PMIC cutoff as pm_power_off so every poweroff path ends in it */
+static bool hook_pm_power_off = true;
+module_param(hook_pm_power_off, bool, 0444);
+MODULE_PARM_DESC(hook_pm_power_off, "Install the atomic PMIC cutoff as pm_power_off (default 1)");
+
+/* TWI controller behind the adapter, mapped at load for polled transfers */
+static void __iomem *twi_base = NULL;
+static resource_size_t twi_size = 0;
+
+/* pm_power_off handler that was installed before ours */
+static void (*prev_pm_power_off)(void) = NULL;
+
+/*
+ * Fault injection, for exercising the failure paths (bench/bench.sh faults).
+ * All off by default; each injected fault leaves a FAULT_* debug marker.
+ */
+static unsigned int fault_i2c_errors = 0;
+module_param(fault_i2c_errors, uint, 0644);
+MODULE_PARM_DESC(fault_i2c_errors, "Fail this many upcoming PMIC transfers with -EIO (default 0)");
+
+static bool fault_umount_busy = false;
+module_param(fault_umount_busy, bool, 0644);
+MODULE_PARM_DESC(fault_umount_busy, "Make every SD card umount attempt report busy (default 0)");
+
+static char *fault_helper_stall = "";
+module_param(fault_helper_stall, charp, 0644);
+MODULE_PARM_DESC(fault_helper_stall, "Replace usermode helpers with this name (e.g. sync, umount) by a hung one (default none)");
+
+/* Cached register map on top of the adapter, and failed PMIC transfers so far */
+static struct regmap *pmic_regmap = NULL;
+static unsigned int pmic_errors = 0;
+
 /* Monitor thread */
 static struct task_struct *monitor_thread = NULL;
 static bool should_stop = false;
@@ -78,6 +207,54 @@ static bool should_stop = false;
 /* Flag to disable SD card logging during unmount */
 static bool sd_logging_enabled = true;
 
+/* Device of the SD card filesystem, captured before the first unmount attempt */
+static dev_t sdcard_dev = 0;
+
+/* Set once kill_all_processes() has run, so the sequence does not repeat it */
+static bool user_processes_killed = false;
+
+/* Battery power_supply registered by the BSP AXP driver (first battery-type supply if absent) */
+static char *battery_supply = "axp2202-battery";
+module_param(battery_supply, charp, 0444);
+MODULE_PARM_DESC(battery_supply, "power_supply name used for battery telemetry (default axp2202-battery)");
+
+/* Battery temperature (0.1C) at signal time above which the thermal fast path is taken; 0 disables */
+static int hot_threshold_dc = 500;
+module_param(hot_threshold_dc, int, 0644);
+MODULE_PARM_DESC(hot_threshold_dc, "Temperature in 0.1C that selects the thermal fast path, 0 = never (default 500)");
+
+/* Optional thermal zone checked alongside the battery, the hotter reading wins */
+static char *thermal_zone = "";
+module_param(thermal_zone, charp, 0444);
+MODULE_PARM_DESC(thermal_zone, "Thermal zone type also checked for the fast path (default none)");
+
+/* Deadline for the thermal fast path, replacing shutdown_budget_ms once it is taken */
+static unsigned int hot_budget_ms = 3000;
+module_param(hot_budget_ms, uint, 0644);
+MODULE_PARM_DESC(hot_budget_ms, "Deadline from signal to PMIC cutoff on the thermal fast path in ms (default 3000)");
+
+/* Stop charging and power down the panel backlight as soon as the signal arrives */
+static bool quiesce_power = true;
+module_param(quiesce_power, bool, 0644);
+MODULE_PARM_DESC(quiesce_power, "Disable charge current and backlight at signal time, poweroff only (default 1)");
+
+/* Start the sequence without a signal file when the discharging battery falls below these; 0 disables */
+static int critical_capacity = 2;
+module_param(critical_capacity, int, 0644);
+MODULE_PARM_DESC(critical_capacity, "Battery capacity in percent that triggers shutdown, 0 = never (default 2)");
+
+static int critical_voltage_mv = 0;
+module_param(critical_voltage_mv, int, 0644);
+MODULE_PARM_DESC(critical_voltage_mv, "Battery voltage in mV that triggers shutdown, 0 = never (default 0)");
+
+/* Set from the battery change handler; wakes the monitor thread early */
+static bool battery_critical = false;
+static DECLARE_WAIT_QUEUE_HEAD(monitor_wq);
+static struct work_struct battery_work;
+
+/* When the signal was seen, so telemetry samples carry their offset into the sequence */
+static ktime_t signal_time;
+
 /* Reusable environment for usermode helper invocations */
 static char *usermode_envp[] = {
     "HOME=/",
@@ -85,31 +262,272 @@ static char *usermode_envp[] = {
     NULL
 };
 
+/* Deadline for each usermode helper before it is killed and the sequence moves on */
+static unsigned int helper_timeout_ms = 5000;
+module_param(helper_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(helper_timeout_ms, "Deadline for each usermode helper in ms (default 5000)");
+
+static int shutdown_rt_priority = 50;
+module_param(shutdown_rt_priority, int, 0644);
+MODULE_PARM_DESC(shutdown_rt_priority, "SCHED_FIFO priority of the shutdown thread and its helpers, 0 = normal scheduling, max 98 (default 50)");
+
+/* The deadline watchdog runs above anything the sequence and its helpers can be given */
+#define SHUTDOWN_RT_PRIO_MAX (MAX_RT_PRIO - 2)
+#define DEADLINE_RT_PRIO (MAX_RT_PRIO - 1)
+
+static int shutdown_cpu = -1;
+module_param(shutdown_cpu, int, 0644);
+MODULE_PARM_DESC(shutdown_cpu, "Pin the shutdown thread to this CPU, -1 = no pin (default -1)");
+
+/* Shutdown thread is running SCHED_FIFO; helpers it starts follow it */
+static bool rt_boosted = false;
+
+static void write_debug_marker(const char *stage);
+
 /*
- * I2C register write to AXP717/AXP2202 PMIC
+ * Shutdown history: a fixed ring of binary records in /root, one per real
+ * shutdown, written just before the PMIC trigger. Bump the version in
+ * HISTORY_MAGIC whenever struct shutdown_record changes.
  */
-static int axp2202_write_reg(u8 reg, u8 value)
-{
-    struct i2c_msg msg;
-    u8 buf[2];
+#define HISTORY_PATH "/root/poweroff_hook.hist"
+#define HISTORY_MAGIC 0x50484802    /* "PHH" v2: flush_sdcard after kill_all */
+#define HISTORY_SLOTS 32
+#define HISTORY_PMIC_STEPS 4
+
+/* A stage is reported as a regression above this share of its median, and by at least the margin */
+#define HISTORY_REGRESSION_PCT 150
+#define HISTORY_REGRESSION_MIN_MS 200
+
+/* Path flags of the sequence in progress, saved with its record */
+#define HISTORY_ESCALATED       0x01
+#define HISTORY_THERMAL         0x02
+#define HISTORY_DEADLINE        0x04
+#define HISTORY_BATTERY         0x08
+#define HISTORY_PROC_TRIGGER    0x10
+static unsigned int shutdown_path;
+
+static void save_shutdown_record(const s16 *pmic_ret, int nret, u32 pmic_us);
+
+/* How long a helper gets to die after SIGKILL before it is abandoned */
+#define HELPER_KILL_GRACE_MS 200
+
+/* Worst-case time from signal detection to the PMIC cutoff; 0 disables the watchdog */
+static unsigned int shutdown_budget_ms = 20000;
+module_param(shutdown_budget_ms, uint, 0644);
+MODULE_PARM_DESC(shutdown_budget_ms, "Deadline from signal to PMIC cutoff in ms, 0 = no watchdog (default 20000)");
+
+/* Sync attempted by the watchdog before it cuts power */
+#define DEADLINE_SYNC_TIMEOUT_MS 1000
+
+/* Deadline watchdog: fires if the sequence has not reached the PMIC cutoff in time */
+static struct hrtimer deadline_timer;
+static struct kthread_worker *deadline_worker;
+static struct kthread_work deadline_work;
+
+/* Delay between a panic and the atomic PMIC cutoff; negative leaves a panicked device alone */
+static int panic_cutoff_ms = 5000;
+module_param(panic_cutoff_ms, int, 0644);
+MODULE_PARM_DESC(panic_cutoff_ms, "Delay from panic to atomic PMIC cutoff in ms, -1 = disabled (default 5000)");
+
+/* Also cut power after an oops (through the deadline watchdog) */
+static bool oops_cutoff = false;
+module_param(oops_cutoff, bool, 0644);
+MODULE_PARM_DESC(oops_cutoff, "Sync and cut power panic_cutoff_ms after any oops (default 0)");
+
+/* Last debug marker written, reported if the kernel dies mid-sequence */
+static char last_stage[64] = "IDLE";
+
+/*
+ * Dry run for signal-file triggers: 1 = time the pipeline without killing,
+ * unmounting or cutting power; 2 = also kill and unmount, stop short of the
+ * cutoff. A signal file containing "dryrun" or "dryrun=2" does the same for
+ * one run. A critical-battery trigger always runs for real.
+ */
+#define DRY_RUN_SAFE 1
+#define DRY_RUN_NO_CUTOFF 2
+static int dry_run = 0;
+module_param(dry_run, int, 0644);
+MODULE_PARM_DESC(dry_run, "Dry run: 0 = off, 1 = no kill/unmount/cutoff, 2 = no cutoff (default 0)");
+
+/* Dry-run level of the sequence in progress */
+static int active_dry_run = 0;
+
+/*
+ * What the sequence ends in. Every action runs the same SD-safe pipeline;
+ * only the final stage differs. halt leaves the rails on and is for testing.
+ */
+enum shutdown_action { ACTION_POWEROFF, ACTION_REBOOT, ACTION_HALT };
+
+static const char * const action_names[] = {
+    [ACTION_POWEROFF] = "poweroff",
+    [ACTION_REBOOT] = "reboot",
+    [ACTION_HALT] = "halt",
+};
+
+/* Action of the sequence in progress */
+static int shutdown_action = ACTION_POWEROFF;
+
+/* Trigger written to /proc/poweroff_hook/trigger, picked up by the monitor thread */
+static bool trigger_requested = false;
+static int trigger_action;
+static int trigger_dry_run;
+
+/* Budget the deadline was last armed with */
+static unsigned int armed_budget_ms;
+
+/* Whoever claims this first (sequence or watchdog) performs the final cutoff */
+static atomic_t cutoff_claimed = ATOMIC_INIT(0);
+
+/*
+ * A usermode helper run from a worker so the shutdown thread can stop waiting.
+ * Shared by the caller and the worker; whichever drops the last ref frees it,
+ * so an abandoned helper never touches freed memory.
+ */
+struct helper_call {
+    struct work_struct work;
+    struct completion done;
+    atomic_t refs;
+    char **argv;
+    pid_t pid;
     int ret;
+};
+
+/*
+ * Helpers run on the module's own workqueue: an abandoned one still returns
+ * into helper_call_work(), so unloading drains the queue before the module
+ * text goes away. The count is only for the unload message.
+ */
+static struct workqueue_struct *helper_wq;
+static atomic_t helpers_outstanding = ATOMIC_INIT(0);
+
+/*
+ * Consume one injected PMIC transfer failure. printk only: this also runs
+ * on the atomic cutoff path, where no marker file can be written.
+ */
+static bool fault_i2c_injected(void)
+{
+    if (!fault_i2c_errors)
+        return false;
+    fault_i2c_errors--;
+    printk(KERN_WARNING "poweroff_hook: FAULT_I2C injected, %u left\n", fault_i2c_errors);
+    return true;
+}
+
+/*
+ * Byte-at-a-time SMBus access for adapters without plain I2C transfers
+ * (i2c-stub in the QEMU bench)
+ */
+static int axp2202_smbus_xfer(char read_write, u8 first_reg, u8 *values, int count)
+{
+    union i2c_smbus_data data;
+    int i, ret;
+
+    for (i = 0; i < count; i++) {
+        data.byte = values[i];
+        ret = i2c_smbus_xfer(i2c_adapter, pmic_addr, 0, read_write, first_reg + i,
+                             I2C_SMBUS_BYTE_DATA, &data);
+        if (ret < 0) {
+            printk(KERN_INFO "poweroff_hook: SMBus %s failed: reg=0x%02x, ret=%d\n",
+                   read_write == I2C_SMBUS_READ ? "read" : "write", first_reg + i, ret);
+            return ret;
+        }
+        if (read_write == I2C_SMBUS_READ)
+            values[i] = data.byte;
+    }
+    return 0;
+}
+
+/* Set once the adapter rejects a multi-message write; later blocks go one register at a time */
+static bool i2c_single_msg_only = false;
+
+/*
+ * Write a run of consecutive AXP717/AXP2202 registers in a single i2c_transfer().
+ * Each register is its own 2-byte message joined by repeated starts: the
+ * adapter is locked and the controller set up once for the whole block. The
+ * datasheet does not document register auto-increment for writes, so a
+ * single burst message is not used. Some controller drivers only take one
+ * message (or write+read) per transfer; on those the block falls back to
+ * one transfer per register, as the single-register writes always did.
+ */
+static int axp2202_write_regs(u8 first_reg, const u8 *values, int count)
+{
+    struct i2c_msg msgs[AXP2202_MAX_BATCH];
+    u8 bufs[AXP2202_MAX_BATCH][2];
+    int i, ret;
 
     if (!i2c_adapter) {
         printk(KERN_INFO "poweroff_hook: I2C adapter not initialized\n");
         return -ENODEV;
     }
+    if (count <= 0 || count > AXP2202_MAX_BATCH)
+        return -EINVAL;
+    if (fault_i2c_injected())
+        return -EIO;
+    if (!i2c_check_functionality(i2c_adapter, I2C_FUNC_I2C))
+        return axp2202_smbus_xfer(I2C_SMBUS_WRITE, first_reg, (u8 *)values, count);
+
+    for (i = 0; i < count; i++) {
+        bufs[i][0] = first_reg + i;
+        bufs[i][1] = values[i];
+        msgs[i].addr = pmic_addr;
+        msgs[i].flags = 0;
+        msgs[i].len = 2;
+        msgs[i].buf = bufs[i];
+    }
+
+    if (count > 1 && !i2c_single_msg_only) {
+        ret = i2c_transfer(i2c_adapter, msgs, count);
+        if (ret == count)
+            return 0;
+        if (ret != -EINVAL && ret != -EOPNOTSUPP) {
+            printk(KERN_INFO "poweroff_hook: I2C batch write failed: reg=0x%02x+%d, ret=%d\n",
+                   first_reg, count, ret);
+            return ret < 0 ? ret : -EIO;
+        }
+        printk(KERN_INFO "poweroff_hook: I2C adapter rejected a %d-message write (%d), writing one register per transfer\n",
+               count, ret);
+        i2c_single_msg_only = true;
+    }
+
+    for (i = 0; i < count; i++) {
+        ret = i2c_transfer(i2c_adapter, &msgs[i], 1);
+        if (ret != 1) {
+            printk(KERN_INFO "poweroff_hook: I2C write failed: reg=0x%02x, ret=%d\n", first_reg + i, ret);
+            return ret < 0 ? ret : -EIO;
+        }
+    }
 
-    buf[0] = reg;
-    buf[1] = value;
+    return 0;
+}
 
-    msg.addr = AXP2202_I2C_ADDR;
-    msg.flags = 0;
-    msg.len = 2;
-    msg.buf = buf;
+/*
+ * Read a run of consecutive registers: register address write, repeated
+ * start, then a multi-byte read using the PMIC's read auto-increment
+ */
+static int axp2202_read_regs(u8 first_reg, u8 *values, int count)
+{
+    struct i2c_msg msgs[2];
+    int ret;
 
-    ret = i2c_transfer(i2c_adapter, &msg, 1);
-    if (ret != 1) {
-        printk(KERN_INFO "poweroff_hook: I2C write failed: reg=0x%02x, ret=%d\n", reg, ret);
+    if (!i2c_adapter)
+        return -ENODEV;
+    if (fault_i2c_injected())
+        return -EIO;
+    if (!i2c_check_functionality(i2c_adapter, I2C_FUNC_I2C))
+        return axp2202_smbus_xfer(I2C_SMBUS_READ, first_reg, values, count);
+
+    msgs[0].addr = pmic_addr;
+    msgs[0].flags = 0;
+    msgs[0].len = 1;
+    msgs[0].buf = &first_reg;
+    msgs[1].addr = pmic_addr;
+    msgs[1].flags = I2C_M_RD;
+    msgs[1].len = count;
+    msgs[1].buf = values;
+
+    ret = i2c_transfer(i2c_adapter, msgs, 2);
+    if (ret != 2) {
+        printk(KERN_INFO "poweroff_hook: I2C read failed: reg=0x%02x+%d, ret=%d\n", first_reg, count, ret);
         return ret < 0 ? ret : -EIO;
     }
 
@@ -117,272 +535,3068 @@ static int axp2202_write_reg(u8 reg, u8 value)
 }
 
 /*
- * Check if /mnt/SDCARD is mounted - properly test the mountpoint
+ * regmap bus over the raw adapter. The PMIC's I2C client belongs to the BSP
+ * AXP driver, so this module cannot bind its own client and talks to the
+ * address directly. Transient bus errors are retried here, below the cache.
  */
-static bool is_sdcard_mounted(void)
+static int axp2202_regmap_write(void *context, const void *data, size_t count)
 {
-    struct path p;
-    bool mounted = false;
+    const u8 *buf = data;
+    int attempt, ret = -EINVAL;
 
-    if (kern_path("/mnt/SDCARD", LOOKUP_FOLLOW, &p) == 0) {
-        mounted = d_mountpoint(p.dentry);  /* true iff something is mounted ON this */
-        path_put(&p);
+    if (count < 2)
+        return -EINVAL;
+
+    for (attempt = 0; attempt < PMIC_I2C_RETRIES; attempt++) {
+        ret = axp2202_write_regs(buf[0], buf + 1, count - 1);
+        if (ret == 0)
+            break;
+        usleep_range(100, 200);
     }
-    return mounted;
+    if (ret)
+        pmic_errors++;
+    return ret;
+}
+
+static int axp2202_regmap_read(void *context, const void *reg_buf, size_t reg_size,
+                               void *val_buf, size_t val_size)
+{
+    int attempt, ret = -EINVAL;
+
+    if (reg_size != 1)
+        return -EINVAL;
+
+    for (attempt = 0; attempt < PMIC_I2C_RETRIES; attempt++) {
+        ret = axp2202_read_regs(*(const u8 *)reg_buf, val_buf, val_size);
+        if (ret == 0)
+            break;
+        usleep_range(100, 200);
+    }
+    if (ret)
+        pmic_errors++;
+    return ret;
+}
+
+/* IRQ enables are also driven by the BSP driver and IRQ status is
+ * write-1-to-clear; 0x27 is a trigger. None of these may be cached. */
+static bool axp2202_volatile_reg(struct device *dev, unsigned int reg)
+{
+    return (reg >= 0x40 && reg <= 0x4C) || reg == 0x27;
+}
+
+static const struct regmap_bus axp2202_regmap_bus = {
+    .write = axp2202_regmap_write,
+    .read = axp2202_regmap_read,
+    .reg_format_endian_default = REGMAP_ENDIAN_NATIVE,
+    .val_format_endian_default = REGMAP_ENDIAN_NATIVE,
+};
+
+static const struct regmap_config axp2202_regmap_config = {
+    .name = "poweroff_hook",
+    .reg_bits = 8,
+    .val_bits = 8,
+    .max_register = 0xFF,
+    .volatile_reg = axp2202_volatile_reg,
+    .cache_type = REGCACHE_RBTREE,
+};
+
+/*
+ * I2C register write to AXP717/AXP2202 PMIC, always sent to the chip.
+ * Used for triggers, which must go out even if the cache already matches.
+ */
+static int axp2202_write_force(u8 first_reg, const u8 *values, int count)
+{
+    int ret;
+
+    if (!pmic_regmap)
+        return -ENODEV;
+
+    ret = regmap_bulk_write(pmic_regmap, first_reg, values, count);
+    if (ret)
+        printk(KERN_INFO "poweroff_hook: I2C write failed: reg=0x%02x+%d, ret=%d\n", first_reg, count, ret);
+    return ret;
+}
+
+/*
+ * Write a block of consecutive registers in one transfer, skipping it when
+ * the cache already holds exactly these values
+ */
+static int axp2202_write_block(u8 first_reg, const u8 *values, int count)
+{
+    unsigned int cached;
+    int i, ret;
+
+    if (!pmic_regmap)
+        return -ENODEV;
+
+    /* Cache-only reads never touch the bus; volatile registers always miss */
+    regcache_cache_only(pmic_regmap, true);
+    for (i = 0; i < count; i++) {
+        if (regmap_read(pmic_regmap, first_reg + i, &cached) || cached != values[i])
+            break;
+    }
+    regcache_cache_only(pmic_regmap, false);
+    if (i == count)
+        return 0;
+
+    ret = regmap_bulk_write(pmic_regmap, first_reg, values, count);
+    if (ret)
+        printk(KERN_INFO "poweroff_hook: I2C block write failed: reg=0x%02x+%d, ret=%d\n",
+               first_reg, count, ret);
+    return ret;
+}
+
+/*
+ * Set registers (writes skipped if the cache says they are already correct),
+ * then read each back from the chip itself. Rewrites up to
+ * PMIC_VERIFY_RETRIES times if the readback disagrees.
+ */
+static int axp2202_write_verified(u8 first_reg, const u8 *values, int count)
+{
+    unsigned int readback = 0;
+    int attempt, i, ret = 0;
+
+    if (!pmic_regmap)
+        return -ENODEV;
+
+    for (i = 0; i < count; i++) {
+        u8 reg = first_reg + i;
+
+        for (attempt = 0; attempt < PMIC_VERIFY_RETRIES; attempt++) {
+            ret = regmap_update_bits(pmic_regmap, reg, 0xFF, values[i]);
+            if (ret)
+                continue;
+
+            regcache_cache_bypass(pmic_regmap, true);
+            ret = regmap_read(pmic_regmap, reg, &readback);
+            regcache_cache_bypass(pmic_regmap, false);
+            if (ret)
+                continue;
+            if (readback == values[i])
+                break;
+
+            /* The chip disagrees with the cache: drop it so the rewrite goes out */
+            printk(KERN_WARNING "poweroff_hook: PMIC reg 0x%02x reads 0x%02x, expected 0x%02x\n",
+                   reg, readback, values[i]);
+            regcache_drop_region(pmic_regmap, reg, reg);
+            ret = -EIO;
+        }
+        if (ret) {
+            pmic_errors++;
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * One step of a PMIC poweroff sequence: a block of consecutive registers and
+ * how to write it. The last step of every sequence is the poweroff trigger.
+ */
+struct pmic_step {
+    const char *name;
+    u8 reg;
+    u8 count;
+    u8 values[AXP2202_MAX_BATCH];
+    int (*write)(u8 first_reg, const u8 *values, int count);
+    unsigned int delay_ms;
+};
+
+/*
+ * A PMIC the module knows how to power off, matched on its device tree node
+ */
+struct pmic_variant {
+    const char *name;
+    const char * const *compatibles;
+    const struct pmic_step *steps;
+    int nsteps;
+};
+
+/* AXP717/AXP2202 (safe minimal version per datasheet v1.0) */
+static const struct pmic_step axp717_steps[] = {
+    /* Step 1: Mask interrupts (registers 0x40-0x44 per datasheet) */
+    { "mask_irq", 0x40, 5, { 0x00, 0x00, 0x00, 0x00, 0x00 }, axp2202_write_block, 0 },
+    /* Step 2: Clear interrupt status flags (registers 0x48-0x4C per datasheet) */
+    { "clear_irq", 0x48, 5, { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF }, axp2202_write_block, 0 },
+    /* Step 3: Configure shutdown sources (0x22 = PWROFF_EN)
+     * Bit 3: LDO Over-Current as poweroff source enable
+     * Bit 1: PWRON > OFFLEVEL as poweroff source enable
+     * Bit 0: Function select (0=poweroff, 1=restart) when button event occurs
+     * 0b00001010 - set bits 1,3 only; verified by readback before the trigger */
+    { "pwroff_en", 0x22, 1, { 0x0A }, axp2202_write_verified, 50 },
+    /* Step 4: TRIGGER SOFTWARE POWER-OFF (Register 0x27, bit 0 = 0x01) */
+    { "trigger", 0x27, 1, { 0x01 }, axp2202_write_force, 0 },
+};
+
+/* BSP and mainline bindings of the Brick's PMIC */
+static const char * const axp717_compatibles[] = { "x-powers,axp2202", "x-powers,axp717", NULL };
+
+/*
+ * Known PMICs. The AXP717/AXP2202 IC type value is not documented, so an
+ * entry matches on the compatible of the node at pmic_addr; the register is
+ * only logged. A new board revision adds its entry here.
+ */
+static const struct pmic_variant pmic_variants[] = {
+    { "AXP717/AXP2202", axp717_compatibles, axp717_steps, ARRAY_SIZE(axp717_steps) },
+};
+
+/* Run the AXP717/AXP2202 sequence without a matching node (bench, odd device trees) */
+static bool pmic_force = false;
+module_param(pmic_force, bool, 0444);
+MODULE_PARM_DESC(pmic_force, "Use the AXP717/AXP2202 sequence without a matching device tree node (default 0)");
+
+/* Selected once at load by probe_pmic_variant(); NULL disables the PMIC cutoff */
+static const struct pmic_variant *pmic_variant = NULL;
+
+/*
+ * Device tree node of the PMIC: the adapter's child whose reg is pmic_addr
+ */
+static struct device_node *find_pmic_node(void)
+{
+    struct device_node *np = i2c_adapter->dev.of_node;
+    struct device_node *child;
+    u32 reg;
+
+    if (!np && i2c_adapter->dev.parent)
+        np = i2c_adapter->dev.parent->of_node;
+    if (!np)
+        return NULL;
+
+    for_each_available_child_of_node(np, child) {
+        if (of_property_read_u32(child, "reg", &reg) == 0 && reg == pmic_addr)
+            return child;
+    }
+    return NULL;
+}
+
+/*
+ * Identify the PMIC once and pick its sequence table. Returns NULL if it is
+ * not one the module knows, so no register is written to an unknown chip.
+ */
+static const struct pmic_variant *probe_pmic_variant(void)
+{
+    const struct pmic_variant *v = NULL;
+    struct device_node *node;
+    const char * const *compat;
+    unsigned int chip_id = 0;
+    int i, ret;
+
+    ret = regmap_read(pmic_regmap, PMIC_CHIP_ID_REG, &chip_id);
+    if (ret)
+        printk(KERN_WARNING "poweroff_hook: Could not read PMIC chip ID (0x%02x): %d\n",
+               PMIC_CHIP_ID_REG, ret);
+
+    node = find_pmic_node();
+    for (i = 0; node && !v && i < ARRAY_SIZE(pmic_variants); i++) {
+        for (compat = pmic_variants[i].compatibles; *compat; compat++) {
+            if (of_device_is_compatible(node, *compat)) {
+                v = &pmic_variants[i];
+                break;
+            }
+        }
+    }
+    of_node_put(node);
+
+    if (!v && pmic_force) {
+        printk(KERN_WARNING "poweroff_hook: No known PMIC node at %d-%04x, forcing %s sequence\n",
+               i2c_bus, pmic_addr, pmic_variants[0].name);
+        v = &pmic_variants[0];
+    }
+    if (!v) {
+        printk(KERN_ERR "poweroff_hook: No AXP717/AXP2202 at %d-%04x (chip ID 0x%02x), PMIC cutoff disabled\n",
+               i2c_bus, pmic_addr, chip_id);
+        return NULL;
+    }
+
+    printk(KERN_INFO "poweroff_hook: PMIC chip ID 0x%02x -> %s sequence (%d steps)\n",
+           chip_id, v->name, v->nsteps);
+    return v;
+}
+
+/*
+ * Map the adapter's TWI controller so the atomic path can drive it directly.
+ * Only Allwinner controllers are handled; anything else keeps using
+ * i2c_transfer(), which in atomic context works only for polling drivers.
+ */
+static void map_twi_controller(void)
+{
+    struct device_node *np = i2c_adapter->dev.of_node;
+    struct resource res;
+    const char *compat;
+
+    if (!np && i2c_adapter->dev.parent)
+        np = i2c_adapter->dev.parent->of_node;
+    if (!np || of_property_read_string(np, "compatible", &compat) ||
+        strncmp(compat, "allwinner,", 10) != 0) {
+        printk(KERN_INFO "poweroff_hook: I2C controller is not an Allwinner TWI, no polled path\n");
+        return;
+    }
+    if (of_address_to_resource(np, 0, &res))
+        return;
+
+    twi_base = ioremap(res.start, resource_size(&res));
+    if (twi_base) {
+        twi_size = resource_size(&res);
+        printk(KERN_INFO "poweroff_hook: Polled TWI path ready (%s @ %pa)\n", compat, &res.start);
+    }
+}
+
+static int twi_wait_flag(void)
+{
+    int us;
+
+    for (us = 0; us < TWI_POLL_TIMEOUT_US; us++) {
+        if (readl(twi_base + TWI_CNTR) & TWI_CNTR_IFLG)
+            return readl(twi_base + TWI_STAT) & 0xFF;
+        udelay(1);
+    }
+    return -ETIMEDOUT;
+}
+
+/* Issue a control action (start, byte, stop) and clear the pending flag */
+static void twi_action(u32 bits)
+{
+    writel(TWI_CNTR_BUS_EN | TWI_CNTR_IFLG | bits, twi_base + TWI_CNTR);
+}
+
+static int twi_send_byte(u8 byte, int expect)
+{
+    writel(byte, twi_base + TWI_DATA);
+    twi_action(0);
+    return twi_wait_flag() == expect ? 0 : -EIO;
+}
+
+static void twi_stop(void)
+{
+    int us;
+
+    twi_action(TWI_CNTR_STP);
+    for (us = 0; us < TWI_POLL_TIMEOUT_US && (readl(twi_base + TWI_CNTR) & TWI_CNTR_STP); us++)
+        udelay(1);
+}
+
+/*
+ * Bring the controller to a known state: whatever the regular driver was
+ * doing when we got here is abandoned. The bus clock survives the reset.
+ */
+static void twi_polled_reset(void)
+{
+    u32 ccr = readl(twi_base + TWI_CCR);
+    int us;
+
+    /* Newer TWIs may be in "driver engine" mode; the byte-level FSM needs it off */
+    if (twi_size > TWI_DRV_CTRL)
+        writel(readl(twi_base + TWI_DRV_CTRL) & ~BIT(0), twi_base + TWI_DRV_CTRL);
+
+    writel(1, twi_base + TWI_SRST);
+    for (us = 0; us < TWI_POLL_TIMEOUT_US && (readl(twi_base + TWI_SRST) & 1); us++)
+        udelay(1);
+    writel(ccr, twi_base + TWI_CCR);
+    writel(TWI_CNTR_BUS_EN, twi_base + TWI_CNTR);
+}
+
+static int twi_polled_write(u8 reg, u8 value)
+{
+    int ret;
+
+    twi_action(TWI_CNTR_STA);
+    ret = twi_wait_flag();
+    if (ret != TWI_STAT_START && ret != TWI_STAT_RSTART)
+        ret = -EIO;
+    else if (!(ret = twi_send_byte(pmic_addr << 1, TWI_STAT_ADDR_W_ACK)) &&
+             !(ret = twi_send_byte(reg, TWI_STAT_DATA_W_ACK)))
+        ret = twi_send_byte(value, TWI_STAT_DATA_W_ACK);
+    twi_stop();
+    return ret;
+}
+
+static int twi_polled_read(u8 reg, u8 *value)
+{
+    int ret;
+
+    twi_action(TWI_CNTR_STA);
+    ret = twi_wait_flag();
+    if (ret != TWI_STAT_START && ret != TWI_STAT_RSTART) {
+        ret = -EIO;
+        goto stop;
+    }
+    ret = twi_send_byte(pmic_addr << 1, TWI_STAT_ADDR_W_ACK);
+    if (!ret)
+        ret = twi_send_byte(reg, TWI_STAT_DATA_W_ACK);
+    if (ret)
+        goto stop;
+
+    twi_action(TWI_CNTR_STA);
+    if (twi_wait_flag() != TWI_STAT_RSTART) {
+        ret = -EIO;
+        goto stop;
+    }
+    ret = twi_send_byte((pmic_addr << 1) | 1, TWI_STAT_ADDR_R_ACK);
+    if (ret)
+        goto stop;
+
+    /* Single byte: receive without ACK */
+    twi_action(0);
+    if (twi_wait_flag() != TWI_STAT_DATA_R_NACK)
+        ret = -EIO;
+    else
+        *value = readl(twi_base + TWI_DATA) & 0xFF;
+stop:
+    twi_stop();
+    return ret;
+}
+
+/*
+ * Single register access that never sleeps: polled controller if mapped,
+ * otherwise i2c_transfer(), which only trylocks the bus in atomic context
+ */
+static int axp2202_atomic_write(u8 reg, u8 value)
+{
+    if (twi_base)
+        return twi_polled_write(reg, value);
+    return axp2202_write_regs(reg, &value, 1);
+}
+
+static int axp2202_atomic_read(u8 reg, u8 *value)
+{
+    if (twi_base)
+        return twi_polled_read(reg, value);
+    return axp2202_read_regs(reg, value, 1);
+}
+
+/*
+ * PMIC cutoff usable with interrupts disabled (pm_power_off, panic, NMI).
+ * Runs the same sequence table as execute_axp2202_poweroff(), bypassing
+ * regmap and its locks, with busy-wait delays. Returns only if power
+ * did not go away.
+ */
+static int axp2202_poweroff_atomic(void)
+{
+    const struct pmic_variant *v = pmic_variant;
+    int i, j, errors = 0;
+    u8 readback;
+
+    if (!i2c_adapter || !v)
+        return -ENODEV;
+    /* Without the polled controller only i2c_transfer() is safe here: it
+     * trylocks the bus in atomic context, the SMBus emulation does not */
+    if (!twi_base && (!i2c_adapter->algo->master_xfer ||
+                      !i2c_check_functionality(i2c_adapter, I2C_FUNC_I2C))) {
+        printk(KERN_EMERG "poweroff_hook: adapter %d is SMBus-only, no atomic PMIC cutoff\n", i2c_bus);
+        return -EOPNOTSUPP;
+    }
+    if (twi_base)
+        twi_polled_reset();
+
+    for (i = 0; i < v->nsteps; i++) {
+        const struct pmic_step *step = &v->steps[i];
+
+        for (j = 0; j < step->count; j++) {
+            if (axp2202_atomic_write(step->reg + j, step->values[j]))
+                errors++;
+            /* Same readback rule as the sleeping path, one rewrite at most */
+            if (step->write == axp2202_write_verified &&
+                (axp2202_atomic_read(step->reg + j, &readback) || readback != step->values[j]) &&
+                axp2202_atomic_write(step->reg + j, step->values[j]))
+                errors++;
+        }
+        if (step->delay_ms)
+            mdelay(step->delay_ms);
+    }
+
+    /* Give the PMIC a moment to latch the shutdown */
+    mdelay(1000);
+    return errors ? -EIO : -ETIMEDOUT;
+}
+
+/*
+ * pm_power_off replacement: any kernel poweroff ends in the clean cutoff.
+ * Falls back to the previous handler if power is still on.
+ */
+static void poweroff_hook_pm_power_off(void)
+{
+    int ret;
+
+    /* The shutdown sequence or its watchdog already ran the cutoff; don't replay it */
+    if (atomic_read(&cutoff_claimed)) {
+        printk(KERN_EMERG "poweroff_hook: pm_power_off - PMIC cutoff already done\n");
+    } else {
+        printk(KERN_EMERG "poweroff_hook: pm_power_off - atomic PMIC cutoff\n");
+        ret = axp2202_poweroff_atomic();
+        printk(KERN_EMERG "poweroff_hook: atomic PMIC cutoff returned %d\n", ret);
+    }
+
+    if (prev_pm_power_off)
+        prev_pm_power_off();
+}
+
+static void helper_call_put(struct helper_call *hc)
+{
+    int i;
+
+    if (!atomic_dec_and_test(&hc->refs))
+        return;
+
+    for (i = 0; hc->argv && hc->argv[i]; i++)
+        kfree(hc->argv[i]);
+    kfree(hc->argv);
+    kfree(hc);
+}
+
+/*
+ * Runs in the new helper process before exec: remember whom to kill, and
+ * give it the shutdown thread's priority so kill and sync are not starved
+ * by the tasks they are stopping
+ */
+static int helper_call_init(struct subprocess_info *info, struct cred *new)
+{
+    struct helper_call *hc = info->data;
+    struct sched_param param = { .sched_priority = clamp(shutdown_rt_priority, 0, SHUTDOWN_RT_PRIO_MAX) };
+
+    WRITE_ONCE(hc->pid, task_pid_nr(current));
+    if (rt_boosted && param.sched_priority > 0)
+        sched_setscheduler(current, SCHED_FIFO, &param);
+    return 0;
+}
+
+static void helper_call_work(struct work_struct *work)
+{
+    struct helper_call *hc = container_of(work, struct helper_call, work);
+    struct subprocess_info *info;
+
+    info = call_usermodehelper_setup(hc->argv[0], hc->argv, usermode_envp, GFP_KERNEL,
+                                     helper_call_init, NULL, hc);
+    hc->ret = info ? call_usermodehelper_exec(info, UMH_WAIT_PROC) : -ENOMEM;
+
+    complete(&hc->done);
+    helper_call_put(hc);
+    atomic_dec(&helpers_outstanding);
+}
+
+/*
+ * call_usermodehelper(UMH_WAIT_PROC) with a deadline. A helper that is still
+ * running at the deadline (e.g. umount or sync stuck on a dying card) is sent
+ * SIGKILL and, if it still does not exit, abandoned. Returns the helper's exit
+ * status or -ETIMEDOUT.
+ */
+static int run_helper(char **argv, unsigned int timeout_ms)
+{
+    static char *argv_stall[] = { "/bin/sleep", "3600", NULL };
+    struct helper_call *hc;
+    char marker_msg[128];
+    int argc, i, ret;
+    pid_t pid;
+
+    /* busybox applets are matched on the applet name */
+    if (fault_helper_stall[0] &&
+        (!strcmp(kbasename(argv[0]), fault_helper_stall) ||
+         (!strcmp(kbasename(argv[0]), "busybox") && argv[1] && !strcmp(argv[1], fault_helper_stall)))) {
+        snprintf(marker_msg, sizeof(marker_msg), "FAULT_HELPER_STALL %s", fault_helper_stall);
+        write_debug_marker(marker_msg);
+        argv = argv_stall;
+    }
+
+    for (argc = 0; argv[argc]; argc++)
+        ;
+
+    hc = kzalloc(sizeof(*hc), GFP_KERNEL);
+    if (!hc)
+        return -ENOMEM;
+    hc->argv = kcalloc(argc + 1, sizeof(*hc->argv), GFP_KERNEL);
+    if (!hc->argv) {
+        kfree(hc);
+        return -ENOMEM;
+    }
+    /* The caller's argv may live on its stack; an abandoned helper outlives it */
+    for (i = 0; i < argc; i++) {
+        hc->argv[i] = kstrdup(argv[i], GFP_KERNEL);
+        if (!hc->argv[i]) {
+            atomic_set(&hc->refs, 1);
+            helper_call_put(hc);
+            return -ENOMEM;
+        }
+    }
+
+    init_completion(&hc->done);
+    atomic_set(&hc->refs, 2);
+    INIT_WORK(&hc->work, helper_call_work);
+    atomic_inc(&helpers_outstanding);
+    queue_work(helper_wq, &hc->work);
+
+    if (wait_for_completion_timeout(&hc->done, msecs_to_jiffies(timeout_ms))) {
+        ret = hc->ret;
+        helper_call_put(hc);
+        return ret;
+    }
+
+    pid = READ_ONCE(hc->pid);
+    printk(KERN_ERR "poweroff_hook: Helper %s stalled for %ums (pid %d), killing it\n",
+           argv[0], timeout_ms, pid);
+    snprintf(marker_msg, sizeof(marker_msg), "HELPER_STALLED %s %s pid=%d after=%ums",
+             argv[0], argc > 1 ? argv[1] : "", pid, timeout_ms);
+    write_debug_marker(marker_msg);
+
+    if (pid) {
+        rcu_read_lock();
+        kill_pid(find_vpid(pid), SIGKILL, 1);
+        rcu_read_unlock();
+    }
+    if (!wait_for_completion_timeout(&hc->done, msecs_to_jiffies(HELPER_KILL_GRACE_MS))) {
+        /* Most likely in D state on the card; leave it behind and keep going */
+        printk(KERN_ERR "poweroff_hook: Helper pid %d did not die, abandoning it\n", pid);
+        write_debug_marker("HELPER_ABANDONED");
+    }
+
+    helper_call_put(hc);
+    return -ETIMEDOUT;
+}
+
+/*
+ * Check if /mnt/SDCARD is mounted - properly test the mountpoint
+ */
+static bool is_sdcard_mounted(void)
+{
+    struct path p;
+    bool mounted = false;
+
+    if (kern_path(SDCARD_PATH, LOOKUP_FOLLOW, &p) == 0) {
+        /* The lookup crosses into whatever is mounted there, so a mounted card
+         * resolves to the root of its own vfsmount; a bare directory does not */
+        mounted = p.dentry == p.mnt->mnt_root;
+        path_put(&p);
+    }
+    return mounted;
+}
+
+/*
+ * Write log entry (best effort, may fail if SD card unmounted)
+ */
+static void write_log(const char *message)
+{
+    struct file *filp;
+    mm_segment_t old_fs;
+    loff_t pos = 0;
+
+    /* Don't write to SD card if logging is disabled (during unmount) */
+    if (!sd_logging_enabled) {
+        return;
+    }
+
+    filp = filp_open(LOG_PATH, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (IS_ERR(filp)) {
+        return;
+    }
+
+    old_fs = get_fs();
+    set_fs(KERNEL_DS);
+    vfs_write(filp, message, strlen(message), &pos);
+    vfs_fsync(filp, 1);
+    set_fs(old_fs);
+    filp_close(filp, NULL);
+}
+
+/*
+ * Write debug marker to /root/poweroff_hook.log
+ * This will be moved to LOG_PATH
+ */
+static void write_debug_marker(const char *stage)
+{
+    struct file *marker_filp;
+    mm_segment_t old_fs;
+    loff_t pos = 0;
+    char msg[384];
+    
+    snprintf(msg, sizeof(msg), "[%s]\n", stage);
+    strlcpy(last_stage, stage, sizeof(last_stage));
+    
+    old_fs = get_fs();
+    set_fs(KERNEL_DS);
+    marker_filp = filp_open("/root/poweroff_hook.log", O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (!IS_ERR(marker_filp)) {
+        vfs_write(marker_filp, msg, strlen(msg), &pos);
+        vfs_fsync(marker_filp, 1);
+        filp_close(marker_filp, NULL);
+    }
+    set_fs(old_fs);
+    
+    printk(KERN_INFO "poweroff_hook: DEBUG MARKER: %s\n", stage);
+}
+
+static int match_battery_supply(struct device *dev, const void *data)
+{
+    struct power_supply *psy = dev_get_drvdata(dev);
+
+    return psy && psy->desc->type == POWER_SUPPLY_TYPE_BATTERY;
+}
+
+static struct power_supply *get_battery_supply(void)
+{
+    struct power_supply *psy;
+    struct device *dev;
+
+    psy = power_supply_get_by_name(battery_supply);
+    if (psy)
+        return psy;
+
+    dev = class_find_device(power_supply_class, NULL, NULL, match_battery_supply);
+    if (!dev)
+        return NULL;
+    psy = power_supply_get_by_name(((struct power_supply *)dev_get_drvdata(dev))->desc->name);
+    put_device(dev);
+    return psy;
+}
+
+/*
+ * Format one battery telemetry sample: temperature, voltage, current and
+ * capacity as reported by the AXP fuel gauge. Readings go through the BSP
+ * driver's power_supply so they share its ADC setup and unit conversion.
+ */
+static void format_battery_sample(const char *stage, char *buf, size_t len)
+{
+    static const enum power_supply_property props[] = {
+        POWER_SUPPLY_PROP_TEMP,
+        POWER_SUPPLY_PROP_VOLTAGE_NOW,
+        POWER_SUPPLY_PROP_CURRENT_NOW,
+        POWER_SUPPLY_PROP_CAPACITY,
+    };
+    static const char * const names[] = { "temp", "vbat", "ibat", "cap" };
+    static const int scale[] = { 1, 1000, 1000, 1 };
+    union power_supply_propval val;
+    struct power_supply *psy;
+    long long offset_ms = 0;
+    size_t pos;
+    int i;
+
+    if (ktime_to_ns(signal_time))
+        offset_ms = ktime_to_ms(ktime_sub(ktime_get(), signal_time));
+
+    pos = scnprintf(buf, len, "BATTERY stage=%s t=%lldms", stage, offset_ms);
+
+    psy = get_battery_supply();
+    if (!psy) {
+        scnprintf(buf + pos, len - pos, " unavailable");
+        return;
+    }
+
+    /* temp in 0.1C, vbat/ibat in mV/mA, cap in percent; failed reads are left out */
+    for (i = 0; i < ARRAY_SIZE(props); i++) {
+        if (power_supply_get_property(psy, props[i], &val) == 0)
+            pos += scnprintf(buf + pos, len - pos, " %s=%d", names[i], val.intval / scale[i]);
+    }
+    power_supply_put(psy);
+}
+
+static void record_battery_sample(const char *stage)
+{
+    char marker[160];
+
+    format_battery_sample(stage, marker, sizeof(marker));
+    write_debug_marker(marker);
+}
+
+/*
+ * Cut the heat sources that would otherwise stay on through sync and
+ * unmount: charge current (through the BSP charger's power_supply) and
+ * the panel backlight. Nothing is restored, so this only runs for a real
+ * poweroff: a dry run returns to the UI and a reboot or halt keeps running
+ * (and the PMIC may keep a zero charge current across them).
+ */
+static void quiesce_power_path(void)
+{
+    static const int bl_types[] = { BACKLIGHT_RAW, BACKLIGHT_PLATFORM, BACKLIGHT_FIRMWARE };
+    union power_supply_propval val = { .intval = 0 };
+    struct backlight_device *bd = NULL;
+    struct power_supply *psy;
+    int charge_ret = -ENODEV, bl_ret = -ENODEV, i;
+    ktime_t start = ktime_get();
+    char marker[128];
+
+    psy = get_battery_supply();
+    if (psy) {
+        if (power_supply_property_is_writeable(psy, POWER_SUPPLY_PROP_CONSTANT_CHARGE_CURRENT) > 0)
+            charge_ret = power_supply_set_property(psy, POWER_SUPPLY_PROP_CONSTANT_CHARGE_CURRENT, &val);
+        else
+            charge_ret = -EPERM;
+        power_supply_put(psy);
+    }
+
+    for (i = 0; i < ARRAY_SIZE(bl_types) && !bd; i++)
+        bd = backlight_device_get_by_type(bl_types[i]);
+    if (bd) {
+        mutex_lock(&bd->ops_lock);
+        if (bd->ops) {
+            bd->props.brightness = 0;
+            bd->props.power = FB_BLANK_POWERDOWN;
+            bl_ret = backlight_update_status(bd);
+        }
+        mutex_unlock(&bd->ops_lock);
+    }
+
+    snprintf(marker, sizeof(marker), "POWER_QUIESCE charge_current=%d backlight=%d time=%lldus",
+             charge_ret, bl_ret, ktime_us_delta(ktime_get(), start));
+    write_debug_marker(marker);
+}
+
+/*
+ * Hottest of the battery and the optional thermal zone, in 0.1C
+ */
+static int read_shutdown_temp(int *temp_dc)
+{
+    union power_supply_propval val;
+    struct power_supply *psy;
+    struct thermal_zone_device *tz;
+    int ret = -ENODEV, mc;
+
+    psy = get_battery_supply();
+    if (psy) {
+        if (power_supply_get_property(psy, POWER_SUPPLY_PROP_TEMP, &val) == 0) {
+            *temp_dc = val.intval;
+            ret = 0;
+        }
+        power_supply_put(psy);
+    }
+
+    if (thermal_zone[0]) {
+        tz = thermal_zone_get_zone_by_name(thermal_zone);
+        if (!IS_ERR(tz) && thermal_zone_get_temp(tz, &mc) == 0 &&
+            (ret || mc / 100 > *temp_dc)) {
+            *temp_dc = mc / 100;
+            ret = 0;
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * Kill all user-space processes safely via usermode helper
+ * Avoids kernel process list traversal issues
+ */
+static void kill_all_processes(void)
+{
+    char *argv_kill_term[] = { "/bin/busybox", "kill", "-TERM", "-1", NULL };
+    char *argv_kill_kill[] = { "/bin/busybox", "kill", "-KILL", "-1", NULL };
+    int ret;
+
+    printk(KERN_INFO "poweroff_hook: Starting graceful process termination (SIGTERM)\n");
+
+    /* First pass: Send SIGTERM for graceful shutdown */
+    ret = run_helper(argv_kill_term, helper_timeout_ms);
+    printk(KERN_INFO "poweroff_hook: busybox kill -TERM -1 returned: %d\n", ret);
+
+    printk(KERN_INFO "poweroff_hook: Sent SIGTERM to all processes, waiting 500ms\n");
+    msleep(500);  /* Give processes time to exit gracefully */
+
+    /* Second pass: Force kill with SIGKILL */
+    printk(KERN_INFO "poweroff_hook: Force killing remaining processes (SIGKILL)\n");
+    ret = run_helper(argv_kill_kill, helper_timeout_ms);
+    printk(KERN_INFO "poweroff_hook: busybox kill -KILL -1 returned: %d\n", ret);
+
+    printk(KERN_INFO "poweroff_hook: Process termination complete\n");
+    msleep(200);  /* Brief wait for processes to die */
+    user_processes_killed = true;
+}
+
+/*
+ * Kill any processes that still hold files on /mnt/SDCARD by inspecting /proc/<pid>/fd
+ */
+static void kill_sdcard_users(void)
+{
+    static char kill_script[] =
+        "for pid_path in /proc/[0-9]*; do "
+            "pid=${pid_path#/proc/}; "
+            "[ \\\"$pid\\\" -le 1 ] && continue; "
+            "for fd in \\\"$pid_path\\\"/fd/*; do "
+                "[ -e \\\"$fd\\\" ] || continue; "
+                "target=$(readlink \\\"$fd\\\" 2>/dev/null) || continue; "
+                "case \\\"$target\\\" in "
+                    "/mnt/SDCARD*) /bin/busybox kill -9 \\\"$pid\\\" 2>/dev/null; continue 2 ;; "
+                "esac; "
+            "done; "
+        "done";
+    char *argv_kill_sdcard[] = { "/bin/sh", "-c", kill_script, NULL };
+    int ret;
+
+    ret = run_helper(argv_kill_sdcard, helper_timeout_ms);
+    printk(KERN_INFO "poweroff_hook: procfd kill script returned: %d\n", ret);
+}
+
+/*
+ * One line of /proc/1/mountinfo, reduced to what the SD card detach needs
+ */
+struct mount_entry {
+    int id;
+    int parent_id;
+    unsigned int major;
+    unsigned int minor;
+    int depth;
+    bool on_sdcard;
+    char mount_point[MOUNT_PATH_LEN];
+    char source[MOUNT_PATH_LEN];
+};
+
+/*
+ * Read a (proc/sysfs) text file into buf, always NUL terminated
+ */
+static ssize_t read_text_file(const char *path, char *buf, size_t size)
+{
+    struct file *filp;
+    mm_segment_t old_fs;
+    loff_t pos = 0;
+    ssize_t total = 0, n;
+
+    filp = filp_open(path, O_RDONLY, 0);
+    if (IS_ERR(filp)) {
+        buf[0] = '\0';
+        return PTR_ERR(filp);
+    }
+
+    old_fs = get_fs();
+    set_fs(KERNEL_DS);
+    while (total < size - 1) {
+        n = vfs_read(filp, buf + total, size - 1 - total, &pos);
+        if (n <= 0)
+            break;
+        total += n;
+    }
+    set_fs(old_fs);
+    filp_close(filp, NULL);
+
+    buf[total] = '\0';
+    return total;
+}
+
+/*
+ * Decode the \ooo octal escapes mountinfo uses for spaces, tabs and newlines
+ */
+static void unescape_mount_path(char *s)
+{
+    char *src = s, *dst = s;
+
+    while (*src) {
+        if (src[0] == '\\' &&
+            src[1] >= '0' && src[1] <= '3' &&
+            src[2] >= '0' && src[2] <= '7' &&
+            src[3] >= '0' && src[3] <= '7') {
+            *dst++ = ((src[1] - '0') << 6) | ((src[2] - '0') << 3) | (src[3] - '0');
+            src += 4;
+        } else {
+            *dst++ = *src++;
+        }
+    }
+    *dst = '\0';
+}
+
+/*
+ * True if path is /mnt/SDCARD itself or anything below it
+ */
+static bool path_on_sdcard(const char *path)
+{
+    size_t len = strlen(SDCARD_PATH);
+
+    return strncmp(path, SDCARD_PATH, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+/*
+ * True if the loop device (e.g. "loop0") is backed by a file on the SD card
+ */
+static bool loop_backed_by_sdcard(const char *loop_name)
+{
+    char sysfs_path[64];
+    char backing[MOUNT_PATH_LEN];
+
+    snprintf(sysfs_path, sizeof(sysfs_path), "/sys/block/%s/loop/backing_file", loop_name);
+    if (read_text_file(sysfs_path, backing, sizeof(backing)) <= 0)
+        return false;
+    return path_on_sdcard(strim(backing));
+}
+
+/*
+ * Parse /proc/1/mountinfo into entries, returns the number of entries
+ */
+static int parse_mountinfo(char *buf, struct mount_entry *entries, int max_entries)
+{
+    char *cursor = buf, *line, *sep;
+    char super_opts[MOUNT_PATH_LEN];
+    int count = 0;
+
+    while ((line = strsep(&cursor, "\n")) != NULL && count < max_entries) {
+        struct mount_entry *e = &entries[count];
+
+        if (!*line)
+            continue;
+
+        memset(e, 0, sizeof(*e));
+        if (sscanf(line, "%d %d %u:%u %*s %255s", &e->id, &e->parent_id,
+                   &e->major, &e->minor, e->mount_point) != 5)
+            continue;
+
+        /* Optional fields end at " - ", followed by fstype, source, super options */
+        sep = strstr(line, " - ");
+        super_opts[0] = '\0';
+        if (sep)
+            sscanf(sep + 3, "%*s %255s %255s", e->source, super_opts);
+
+        unescape_mount_path(e->mount_point);
+        unescape_mount_path(e->source);
+
+        /* Overlay and similar mounts reference the card only through their options */
+        if (strstr(super_opts, SDCARD_PATH))
+            e->on_sdcard = true;
+        if (strncmp(e->source, "/dev/loop", 9) == 0 && loop_backed_by_sdcard(e->source + 5))
+            e->on_sdcard = true;
+
+        count++;
+    }
+
+    return count;
+}
+
+/*
+ * Run umount on one mount, falling back to a lazy detach if it is busy
+ */
+static void unmount_stacked_mount(const struct mount_entry *e)
+{
+    char *argv_umount[] = { "/bin/umount", (char *)e->mount_point, NULL };
+    char *argv_umount_lazy[] = { "/bin/umount", "-l", (char *)e->mount_point, NULL };
+    char marker_msg[MOUNT_PATH_LEN + 64];
+    int ret;
+
+    ret = run_helper(argv_umount, helper_timeout_ms);
+    printk(KERN_INFO "poweroff_hook: umount %s (%s) returned: %d\n", e->mount_point, e->source, ret);
+    if (ret == 0)
+        return;
+
+    /* This mount was holding the card; record it so the root cause can be fixed */
+    snprintf(marker_msg, sizeof(marker_msg), "UNMOUNT_STACK_BLOCKED %s (%s) ret=%d",
+             e->mount_point, e->source, ret);
+    write_debug_marker(marker_msg);
+
+    ret = run_helper(argv_umount_lazy, helper_timeout_ms);
+    printk(KERN_INFO "poweroff_hook: umount -l %s returned: %d\n", e->mount_point, ret);
+}
+
+/*
+ * Detach every loop device whose backing file lives on the SD card
+ */
+static void detach_sdcard_loop_devices(void)
+{
+    char loop_name[16];
+    char loop_dev[32];
+    char *argv_losetup[] = { "/bin/busybox", "losetup", "-d", loop_dev, NULL };
+    int i, ret;
+
+    for (i = 0; i < MAX_LOOP_DEVICES; i++) {
+        snprintf(loop_name, sizeof(loop_name), "loop%d", i);
+        if (!loop_backed_by_sdcard(loop_name))
+            continue;
+
+        snprintf(loop_dev, sizeof(loop_dev), "/dev/%s", loop_name);
+        ret = run_helper(argv_losetup, helper_timeout_ms);
+        printk(KERN_INFO "poweroff_hook: losetup -d %s returned: %d\n", loop_dev, ret);
+    }
+}
+
+/*
+ * Unmount everything stacked on or under /mnt/SDCARD, children before parents.
+ * Covers submounts, bind mounts of card directories elsewhere (same device),
+ * overlays using card directories and loop mounts of images on the card.
+ * The card's own mount is left to the caller. Returns the number of mounts detached.
+ */
+static int unmount_sdcard_stack(void)
+{
+    struct mount_entry *entries;
+    int *order;
+    char *buf;
+    int count, selected = 0, base = -1;
+    int i, j, changed;
+
+    buf = kmalloc(MOUNTINFO_BUF_SIZE, GFP_KERNEL);
+    entries = kcalloc(MAX_MOUNTS, sizeof(*entries), GFP_KERNEL);
+    order = kcalloc(MAX_MOUNTS, sizeof(*order), GFP_KERNEL);
+    if (!buf || !entries || !order) {
+        printk(KERN_ERR "poweroff_hook: Out of memory while scanning mounts\n");
+        goto out;
+    }
+
+    if (read_text_file(MOUNTINFO_PATH, buf, MOUNTINFO_BUF_SIZE) <= 0) {
+        printk(KERN_WARNING "poweroff_hook: Could not read %s\n", MOUNTINFO_PATH);
+        goto out;
+    }
+    count = parse_mountinfo(buf, entries, MAX_MOUNTS);
+
+    /* The card's own mount is the first one on /mnt/SDCARD */
+    for (i = 0; i < count; i++) {
+        if (strcmp(entries[i].mount_point, SDCARD_PATH) == 0) {
+            base = i;
+            break;
+        }
+    }
+    if (base < 0)
+        goto detach_loops;
+
+    for (i = 0; i < count; i++) {
+        struct mount_entry *e = &entries[i];
+
+        if (i == base)
+            continue;
+        if (path_on_sdcard(e->mount_point) ||
+            (e->major == entries[base].major && e->minor == entries[base].minor))
+            e->on_sdcard = true;
+    }
+
+    /* Anything mounted beneath a selected mount has to go first as well */
+    do {
+        changed = 0;
+        for (i = 0; i < count; i++) {
+            if (entries[i].on_sdcard || i == base)
+                continue;
+            for (j = 0; j < count; j++) {
+                if (entries[j].id == entries[i].parent_id && entries[j].on_sdcard && j != base) {
+                    entries[i].on_sdcard = true;
+                    changed = 1;
+                    break;
+                }
+            }
+        }
+    } while (changed);
+
+    /* Depth in the mount tree orders the detach: deepest first, newest first on ties */
+    for (i = 0; i < count; i++) {
+        int parent = entries[i].parent_id, hops;
+
+        for (hops = 0; hops < count; hops++) {
+            for (j = 0; j < count; j++) {
+                if (entries[j].id == parent && entries[j].id != entries[j].parent_id)
+                    break;
+            }
+            if (j == count)
+                break;
+            parent = entries[j].parent_id;
+        }
+        entries[i].depth = hops;
+
+        if (entries[i].on_sdcard && i != base && strcmp(entries[i].mount_point, "/") != 0)
+            order[selected++] = i;
+    }
+
+    for (i = 1; i < selected; i++) {
+        int cur = order[i];
+
+        for (j = i - 1; j >= 0; j--) {
+            const struct mount_entry *prev = &entries[order[j]];
+
+            if (prev->depth > entries[cur].depth ||
+                (prev->depth == entries[cur].depth && order[j] > cur))
+                break;
+            order[j + 1] = order[j];
+        }
+        order[j + 1] = cur;
+    }
+
+    printk(KERN_INFO "poweroff_hook: %d mount(s) stacked on %s (%u:%u)\n",
+           selected, SDCARD_PATH, entries[base].major, entries[base].minor);
+    for (i = 0; i < selected; i++)
+        unmount_stacked_mount(&entries[order[i]]);
+
+detach_loops:
+    /* Loop devices keep their image file open on the card even once unmounted */
+    detach_sdcard_loop_devices();
+
+out:
+    kfree(order);
+    kfree(entries);
+    kfree(buf);
+    return selected;
+}
+
+/*
+ * A task holding a reference to the SD card filesystem
+ */
+struct sdcard_blocker {
+    pid_t pid;
+    pid_t stack_pid;        /* thread in D state, if any */
+    char state;
+    char comm[TASK_COMM_LEN];
+    const char *kind;       /* "fd", "cwd", "root" or "mmap" */
+    int refs;
+    bool mmap_skipped;      /* mmap_sem was held, mappings not checked */
+    char path[MOUNT_PATH_LEN];
+};
+
+/*
+ * Remember which device backs /mnt/SDCARD while it is still reachable by path
+ */
+static void capture_sdcard_dev(void)
+{
+    struct path p;
+
+    if (kern_path(SDCARD_PATH, LOOKUP_FOLLOW, &p) == 0) {
+        if (p.dentry == p.mnt->mnt_root)
+            sdcard_dev = p.mnt->mnt_sb->s_dev;
+        path_put(&p);
+    }
+}
+
+static bool path_is_sdcard(const struct path *path)
+{
+    return path->dentry && path->dentry->d_sb->s_dev == sdcard_dev;
+}
+
+/*
+ * Record a reference to the card, keeping the first path seen for each task
+ */
+static void note_blocker_ref(struct sdcard_blocker *b, const char *kind, const struct path *path)
+{
+    char *tmp, *name;
+
+    if (b->refs++ > 0)
+        return;
+
+    b->kind = kind;
+    tmp = b->path;
+    name = d_path(path, tmp, sizeof(b->path));
+    if (IS_ERR(name))
+        strlcpy(b->path, "?", sizeof(b->path));
+    else
+        memmove(b->path, name, strlen(name) + 1);
+}
+
+static int blocker_fd_cb(const void *data, struct file *f, unsigned int fd)
+{
+    struct sdcard_blocker *b = (struct sdcard_blocker *)data;
+
+    if (path_is_sdcard(&f->f_path))
+        note_blocker_ref(b, "fd", &f->f_path);
+    return 0;
+}
+
+/*
+ * ps-style state letter; 4.9 has no task_state_to_char()
+ */
+static char task_state_char(struct task_struct *t)
+{
+    long state = READ_ONCE(t->state);
+
+    if (state == TASK_RUNNING)
+        return 'R';
+    if (state & TASK_UNINTERRUPTIBLE)
+        return 'D';
+    if (state & TASK_INTERRUPTIBLE)
+        return 'S';
+    if (state & (__TASK_STOPPED | __TASK_TRACED))
+        return 'T';
+    if (t->exit_state)
+        return 'Z';
+    return '?';
+}
+
+/*
+ * Check one process for open files, cwd/root and file mappings on the card
+ */
+static void scan_task_for_sdcard(struct task_struct *p, struct sdcard_blocker *b)
+{
+    struct mm_struct *mm;
+    struct vm_area_struct *vma;
+
+    task_lock(p);
+    if (p->files)
+        iterate_fd(p->files, 0, blocker_fd_cb, b);
+    if (p->fs) {
+        spin_lock(&p->fs->lock);
+        if (path_is_sdcard(&p->fs->pwd))
+            note_blocker_ref(b, "cwd", &p->fs->pwd);
+        if (path_is_sdcard(&p->fs->root))
+            note_blocker_ref(b, "root", &p->fs->root);
+        spin_unlock(&p->fs->lock);
+    }
+    task_unlock(p);
+
+    /* A task stuck in D state may hold mmap_sem for good; never wait on it here */
+    mm = get_task_mm(p);
+    if (mm) {
+        if (down_read_trylock(&mm->mmap_sem)) {
+            for (vma = mm->mmap; vma; vma = vma->vm_next) {
+                if (vma->vm_file && path_is_sdcard(&vma->vm_file->f_path))
+                    note_blocker_ref(b, "mmap", &vma->vm_file->f_path);
+            }
+            up_read(&mm->mmap_sem);
+        } else {
+            b->mmap_skipped = true;
+        }
+        mmput(mm);
+    }
+}
+
+/*
+ * Copy the kernel stack of a D-state thread into the shutdown record
+ */
+static void record_blocker_stack(pid_t pid)
+{
+    char stack_path[32];
+    char marker_msg[160];
+    char *buf, *cursor, *line, *frame;
+    int lines = 0;
+
+    buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    if (!buf)
+        return;
+
+    snprintf(stack_path, sizeof(stack_path), "/proc/%d/stack", pid);
+    if (read_text_file(stack_path, buf, PAGE_SIZE) > 0) {
+        cursor = buf;
+        while ((line = strsep(&cursor, "\n")) != NULL && lines < MAX_STACK_LINES) {
+            if (!*line)
+                continue;
+            /* Drop the "[<address>] " prefix, the symbol is what matters */
+            frame = strstr(line, "] ");
+            frame = frame ? frame + 2 : line;
+            snprintf(marker_msg, sizeof(marker_msg), "SDCARD_BLOCKER_STACK pid=%d %s", pid, frame);
+            write_debug_marker(marker_msg);
+            lines++;
+        }
+    }
+    kfree(buf);
+}
+
+/*
+ * Record active swap areas that live on the card
+ */
+static void record_sdcard_swap(void)
+{
+    char marker_msg[MOUNT_PATH_LEN + 32];
+    char swap_file[MOUNT_PATH_LEN];
+    char *buf, *cursor, *line;
+
+    buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    if (!buf)
+        return;
+
+    if (read_text_file("/proc/swaps", buf, PAGE_SIZE) > 0) {
+        cursor = buf;
+        strsep(&cursor, "\n");    /* header */
+        while ((line = strsep(&cursor, "\n")) != NULL) {
+            if (sscanf(line, "%255s", swap_file) != 1)
+                continue;
+            unescape_mount_path(swap_file);
+            if (!path_on_sdcard(swap_file))
+                continue;
+            snprintf(marker_msg, sizeof(marker_msg), "SDCARD_BLOCKER swap=%s", swap_file);
+            write_debug_marker(marker_msg);
+        }
+    }
+    kfree(buf);
+}
+
+/*
+ * Record mounts still present on or under the card
+ */
+static void record_sdcard_child_mounts(void)
+{
+    struct mount_entry *entries;
+    char marker_msg[2 * MOUNT_PATH_LEN + 32];
+    char *buf;
+    int count, i;
+
+    buf = kmalloc(MOUNTINFO_BUF_SIZE, GFP_KERNEL);
+    entries = kcalloc(MAX_MOUNTS, sizeof(*entries), GFP_KERNEL);
+    if (buf && entries && read_text_file(MOUNTINFO_PATH, buf, MOUNTINFO_BUF_SIZE) > 0) {
+        count = parse_mountinfo(buf, entries, MAX_MOUNTS);
+        for (i = 0; i < count; i++) {
+            if (!path_on_sdcard(entries[i].mount_point) && !entries[i].on_sdcard)
+                continue;
+            snprintf(marker_msg, sizeof(marker_msg), "SDCARD_BLOCKER mount=%s (%s)",
+                     entries[i].mount_point, entries[i].source);
+            write_debug_marker(marker_msg);
+        }
+    }
+    kfree(entries);
+    kfree(buf);
+}
+
+/*
+ * Identify what still pins the SD card: tasks with open files, cwd/root or
+ * file mappings on it (with state, and kernel stack if in D state), swap
+ * files and mounts. Everything goes to the shutdown record.
+ */
+static void report_sdcard_blockers(void)
+{
+    struct task_struct **tasks;
+    struct task_struct *p, *t;
+    struct sdcard_blocker *blockers;
+    char marker_msg[MOUNT_PATH_LEN + 96];
+    int ntasks = 0, nblockers = 0, i;
+
+    write_debug_marker("SDCARD_BLOCKERS_START");
+
+    if (!sdcard_dev) {
+        printk(KERN_WARNING "poweroff_hook: SD card device unknown, cannot scan for blockers\n");
+        goto other_refs;
+    }
+
+    tasks = kcalloc(MAX_SCAN_TASKS, sizeof(*tasks), GFP_KERNEL);
+    blockers = kcalloc(MAX_BLOCKERS, sizeof(*blockers), GFP_KERNEL);
+    if (!tasks || !blockers) {
+        kfree(tasks);
+        kfree(blockers);
+        goto other_refs;
+    }
+
+    /* Pin the user processes, the per-task checks below may sleep */
+    rcu_read_lock();
+    for_each_process(p) {
+        if (p->flags & PF_KTHREAD || p == current || ntasks >= MAX_SCAN_TASKS)
+            continue;
+        get_task_struct(p);
+        tasks[ntasks++] = p;
+    }
+    rcu_read_unlock();
+
+    for (i = 0; i < ntasks; i++) {
+        struct sdcard_blocker *b = &blockers[nblockers];
+
+        p = tasks[i];
+        if (nblockers < MAX_BLOCKERS) {
+            memset(b, 0, sizeof(*b));
+            scan_task_for_sdcard(p, b);
+            /* Unchecked mappings may be what holds the card: report those too */
+            if (b->refs || b->mmap_skipped) {
+                b->pid = task_pid_nr(p);
+                get_task_comm(b->comm, p);
+                b->state = task_state_char(p);
+
+                /* A process is as stuck as its most stuck thread */
+                rcu_read_lock();
+                for_each_thread(p, t) {
+                    if (task_state_char(t) == 'D') {
+                        b->state = 'D';
+                        b->stack_pid = task_pid_nr(t);
+                        break;
+                    }
+                }
+                rcu_read_unlock();
+                nblockers++;
+            }
+        }
+        put_task_struct(p);
+    }
+
+    for (i = 0; i < nblockers; i++) {
+        struct sdcard_blocker *b = &blockers[i];
+
+        printk(KERN_WARNING "poweroff_hook: SD blocker pid=%d comm=%s state=%c %s=%s refs=%d%s\n",
+               b->pid, b->comm, b->state, b->kind ? b->kind : "mmap", b->kind ? b->path : "?",
+               b->refs, b->mmap_skipped ? " mmap_skipped" : "");
+        snprintf(marker_msg, sizeof(marker_msg), "SDCARD_BLOCKER pid=%d comm=%s state=%c %s=%s refs=%d%s",
+                 b->pid, b->comm, b->state, b->kind ? b->kind : "mmap", b->kind ? b->path : "?",
+                 b->refs, b->mmap_skipped ? " mmap_skipped" : "");
+        write_debug_marker(marker_msg);
+        if (b->state == 'D')
+            record_blocker_stack(b->stack_pid);
+    }
+
+    kfree(blockers);
+    kfree(tasks);
+
+other_refs:
+    record_sdcard_swap();
+    record_sdcard_child_mounts();
+    write_debug_marker("SDCARD_BLOCKERS_DONE");
+}
+
+/* Signalled once disable_swap() is past its kill -1, which would take concurrent helpers with it */
+static DECLARE_COMPLETION(swap_reclaim_done);
+
+/*
+ * Disable only the swap areas that matter for a clean unmount.
+ * zram and swap off the card are skipped: their contents die with the power
+ * and they do not pin the card. Swap files on the card must be released
+ * before it can be unmounted; if one is in use, the owning processes are
+ * killed first so their swapped pages are freed instead of read back.
+ */
+static void disable_swap(void)
+{
+    char *argv_swapoff_all[] = { "/usr/sbin/swapoff", "-a", NULL };
+    struct swap_area {
+        char file[MOUNT_PATH_LEN];
+        unsigned long used_kb;
+    } *areas;
+    char *argv_swapoff[] = { "/usr/sbin/swapoff", NULL, NULL };
+    char marker_msg[MOUNT_PATH_LEN + 64];
+    char swap_type[16];
+    char *buf, *cursor, *line;
+    unsigned long size_kb, card_used_kb = 0;
+    int count = 0, skipped = 0, released = 0, i, ret;
+    ktime_t start = ktime_get();
+
+    buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    areas = kcalloc(MAX_SWAP_AREAS, sizeof(*areas), GFP_KERNEL);
+    if (!buf || !areas || read_text_file("/proc/swaps", buf, PAGE_SIZE) < 0) {
+        kfree(areas);
+        kfree(buf);
+        complete_all(&swap_reclaim_done);
+        ret = run_helper(argv_swapoff_all, helper_timeout_ms);
+        printk(KERN_INFO "poweroff_hook: swapoff -a returned: %d\n", ret);
+        return;
+    }
+
+    cursor = buf;
+    strsep(&cursor, "\n");    /* header */
+    while ((line = strsep(&cursor, "\n")) != NULL && count < MAX_SWAP_AREAS) {
+        if (sscanf(line, "%255s %15s %lu %lu", areas[count].file, swap_type,
+                   &size_kb, &areas[count].used_kb) != 4)
+            continue;
+        unescape_mount_path(areas[count].file);
+        if (path_on_sdcard(areas[count].file))
+            card_used_kb += areas[count].used_kb;
+        count++;
+    }
+    kfree(buf);
+
+    if (card_used_kb > 0 && !user_processes_killed) {
+        printk(KERN_INFO "poweroff_hook: %lu KB swapped to the SD card, killing user processes first\n",
+               card_used_kb);
+        write_debug_marker("SWAP_RECLAIM_BY_KILL");
+        kill_all_processes();
+    }
+    complete_all(&swap_reclaim_done);
+
+    for (i = 0; i < count; i++) {
+        const char *file = areas[i].file;
+
+        if (strncmp(file, "/dev/zram", 9) == 0) {
+            snprintf(marker_msg, sizeof(marker_msg), "SWAP_SKIP_ZRAM %s used=%luKB", file, areas[i].used_kb);
+        } else if (!path_on_sdcard(file)) {
+            snprintf(marker_msg, sizeof(marker_msg), "SWAP_SKIP_OFF_CARD %s used=%luKB", file, areas[i].used_kb);
+        } else {
+            ktime_t area_start = ktime_get();
+
+            argv_swapoff[1] = (char *)file;
+            ret = run_helper(argv_swapoff, helper_timeout_ms);
+            printk(KERN_INFO "poweroff_hook: swapoff %s returned: %d\n", file, ret);
+            snprintf(marker_msg, sizeof(marker_msg), "SWAP_RELEASED %s used=%luKB ret=%d time=%lldms",
+                     file, areas[i].used_kb, ret, ktime_us_delta(ktime_get(), area_start) / 1000);
+            write_debug_marker(marker_msg);
+            released++;
+            continue;
+        }
+        write_debug_marker(marker_msg);
+        skipped++;
+    }
+    kfree(areas);
+
+    snprintf(marker_msg, sizeof(marker_msg), "SWAP_SUMMARY areas=%d released=%d skipped=%d time=%lldms",
+             count, released, skipped, ktime_us_delta(ktime_get(), start) / 1000);
+    write_debug_marker(marker_msg);
+}
+
+/* How long the flush waits for a lazily detached card's superblock to go */
+#define SB_RELEASE_TIMEOUT_MS 1000
+#define SB_RELEASE_POLL_MS 20
+
+/*
+ * Flush the SD card's block device. sync_blockdev() waits for every write
+ * to be acknowledged by the card and blkdev_issue_flush() sends a cache
+ * flush barrier for cards with a write cache, so nothing is left in flight
+ * when the PMIC cuts the rails.
+ *
+ * After a lazy unmount the superblock lives on until its last user lets
+ * go, and FAT's teardown writes happen then. With wait_release the flush
+ * waits for the superblock to be gone first (is_sdcard_mounted() only
+ * says it left the namespace) and fails with -EBUSY if it never goes.
+ */
+static int flush_sdcard_blockdev(bool wait_release)
+{
+    struct block_device *bdev;
+    struct super_block *sb;
+    char marker_msg[128];
+    ktime_t start;
+    int ret, flush_ret, waited = 0;
+    bool sb_busy = false;
+
+    if (!sdcard_dev || !MAJOR(sdcard_dev)) {
+        printk(KERN_WARNING "poweroff_hook: SD card is not block backed, skipping flush\n");
+        return -ENODEV;
+    }
+
+    start = ktime_get();
+    bdev = blkdev_get_by_dev(sdcard_dev, FMODE_READ | FMODE_WRITE, NULL);
+    if (IS_ERR(bdev)) {
+        printk(KERN_ERR "poweroff_hook: Could not open SD block device %u:%u, error=%ld\n",
+               MAJOR(sdcard_dev), MINOR(sdcard_dev), PTR_ERR(bdev));
+        return PTR_ERR(bdev);
+    }
+
+    while (wait_release && (sb = get_super(bdev)) != NULL) {
+        drop_super(sb);
+        if (waited >= SB_RELEASE_TIMEOUT_MS) {
+            sb_busy = true;
+            break;
+        }
+        msleep(SB_RELEASE_POLL_MS);
+        waited += SB_RELEASE_POLL_MS;
+    }
+
+    ret = sync_blockdev(bdev);
+    flush_ret = blkdev_issue_flush(bdev, GFP_KERNEL, NULL);
+    blkdev_put(bdev, FMODE_READ | FMODE_WRITE);
+
+    /* Queues without a volatile write cache complete the flush as a no-op */
+    if (flush_ret == -EOPNOTSUPP)
+        flush_ret = 0;
+    if (!ret)
+        ret = flush_ret;
+    /* Flushed anyway, but whatever the filesystem writes later is not covered */
+    if (!ret && sb_busy)
+        ret = -EBUSY;
+
+    snprintf(marker_msg, sizeof(marker_msg), "SDCARD_BLOCK_FLUSH dev=%u:%u sb_wait=%dms%s ret=%d time=%lldus",
+             MAJOR(sdcard_dev), MINOR(sdcard_dev), waited, sb_busy ? " sb_busy" : "", ret,
+             ktime_us_delta(ktime_get(), start));
+    write_debug_marker(marker_msg);
+    return ret;
+}
+
+/*
+ * Independent shutdown work runs in this async domain. Joining it is the
+ * dependency edge into the SD card detach: nothing is unmounted until
+ * every job in the domain has finished.
+ */
+static ASYNC_DOMAIN_EXCLUSIVE(shutdown_domain);
+
+static void async_sync_all(void *data, async_cookie_t cookie)
+{
+    char *argv_sync[] = { "/bin/sync", NULL };
+    int ret;
+
+    wait_for_completion(&swap_reclaim_done);
+    printk(KERN_INFO "poweroff_hook: Syncing all filesystems\n");
+    write_debug_marker("UNMOUNT_SYNC_START");
+    ret = run_helper(argv_sync, helper_timeout_ms);
+    printk(KERN_INFO "poweroff_hook: sync returned: %d\n", ret);
+    msleep(100);
+    write_debug_marker("UNMOUNT_SYNC_DONE");
+}
+
+static void async_disable_swap(void *data, async_cookie_t cookie)
+{
+    printk(KERN_INFO "poweroff_hook: Disabling swap\n");
+    write_debug_marker("UNMOUNT_SWAPOFF_START");
+    disable_swap();
+    write_debug_marker("UNMOUNT_SWAPOFF_DONE");
+}
+
+static void async_umount_profile(void *data, async_cookie_t cookie)
+{
+    char *argv_umount_profile[] = { "/bin/umount", "-f", "/etc/profile", NULL };
+    int ret;
+
+    wait_for_completion(&swap_reclaim_done);
+    printk(KERN_INFO "poweroff_hook: Unmounting /etc/profile\n");
+    write_debug_marker("UNMOUNT_PROFILE_START");
+    ret = run_helper(argv_umount_profile, helper_timeout_ms);
+    printk(KERN_INFO "poweroff_hook: umount /etc/profile returned: %d\n", ret);
+    write_debug_marker("UNMOUNT_PROFILE_DONE");
+}
+
+static void async_quiesce_power(void *data, async_cookie_t cookie)
+{
+    quiesce_power_path();
+}
+
+/*
+ * Stage: sync, release swap and everything else that would pin the card,
+ * then stop logging to it and detach what is stacked on top of it. Sync,
+ * swapoff and the /etc/profile umount do not depend on each other and
+ * run concurrently.
+ */
+static int stage_unmount_prepare(int attempt)
+{
+    char *argv_sync[] = { "/bin/sync", NULL };
+    char marker[64];
+    ktime_t start = ktime_get();
+    int ret;
+
+    capture_sdcard_dev();
+
+    /* Swap first: if the async core has to fall back to running jobs inline,
+     * the others must not wait on a completion nobody has started yet */
+    async_schedule_domain(async_disable_swap, NULL, &shutdown_domain);
+    async_schedule_domain(async_sync_all, NULL, &shutdown_domain);
+    async_schedule_domain(async_umount_profile, NULL, &shutdown_domain);
+    async_synchronize_full_domain(&shutdown_domain);
+
+    snprintf(marker, sizeof(marker), "UNMOUNT_PARALLEL_DONE time=%lldms",
+             ktime_to_ms(ktime_sub(ktime_get(), start)));
+    write_debug_marker(marker);
+    
+    /* CRITICAL: Stop writing to SD card before unmounting it! */
+    printk(KERN_INFO "poweroff_hook: Disabling SD card logging\n");
+    write_debug_marker("UNMOUNT_DISABLE_SD_LOGGING");
+    sd_logging_enabled = false;
+    
+    /* Extra sync to flush any pending writes to SD card */
+    printk(KERN_INFO "poweroff_hook: Final SD card sync before unmount\n");
+    write_debug_marker("UNMOUNT_SDCARD_PRE_SYNC");
+    ret = run_helper(argv_sync, helper_timeout_ms);
+    printk(KERN_INFO "poweroff_hook: pre-unmount sync returned: %d\n", ret);
+    msleep(500); /* Give extra time for writes to complete */
+    write_debug_marker("UNMOUNT_SDCARD_PRE_SYNC_DONE");
+    
+    /* Detach bind, loop, overlay and sub-mounts first so nothing pins the card */
+    printk(KERN_INFO "poweroff_hook: Unmounting mounts stacked on /mnt/SDCARD\n");
+    write_debug_marker("UNMOUNT_STACK_START");
+    ret = unmount_sdcard_stack();
+    printk(KERN_INFO "poweroff_hook: Detached %d stacked mount(s)\n", ret);
+    write_debug_marker("UNMOUNT_STACK_DONE");
+
+    return 0;
+}
+
+/* Defined with the stage table, whose pins it restores */
+static void stage_msleep(unsigned int ms);
+
+/*
+ * Stage: one umount -f -l attempt on the card. Retries come from the stage
+ * policy; a umount that had to be killed returns -ETIMEDOUT, which is
+ * never retried since the card itself is hanging.
+ */
+static int stage_unmount_sdcard(int attempt)
+{
+    char *argv_sync[] = { "/bin/sync", NULL };
+    char *argv_umount_force_lazy[] = { "/bin/umount", "-f", "-l", "/mnt/SDCARD", NULL };
+    char marker_msg[64];
+    int ret;
+
+    if (attempt > 0) {
+        /* Force sync before next retry */
+        write_debug_marker("UNMOUNT_SDCARD_RETRY_SYNC");
+        ret = run_helper(argv_sync, helper_timeout_ms);
+        printk(KERN_INFO "poweroff_hook: retry sync returned: %d\n", ret);
+        stage_msleep(300);
+    }
+
+    snprintf(marker_msg, sizeof(marker_msg), "UNMOUNT_SDCARD_ATTEMPT_%d", attempt + 1);
+    write_debug_marker(marker_msg);
+    
+    /* Kill any processes still using the SD card */
+    if (attempt > 0) {
+        write_debug_marker("UNMOUNT_SDCARD_LSOF_KILL");
+        kill_sdcard_users();
+        stage_msleep(200);
+        /* Mounts may have appeared since the first pass */
+        unmount_sdcard_stack();
+    }
+
+    /* Try force + lazy unmount together */
+    if (fault_umount_busy) {
+        write_debug_marker("FAULT_UMOUNT_BUSY");
+        ret = -EBUSY;
+    } else {
+        ret = run_helper(argv_umount_force_lazy, helper_timeout_ms);
+    }
+    printk(KERN_INFO "poweroff_hook: umount -f -l /mnt/SDCARD returned: %d\n", ret);
+    
+    write_debug_marker("UNMOUNT_SDCARD_WAIT_START");
+    stage_msleep(800); /* Wait longer for unmount to complete */
+    write_debug_marker("UNMOUNT_SDCARD_WAIT_DONE");
+    
+    write_debug_marker("UNMOUNT_SDCARD_CHECK_START");
+    if (!is_sdcard_mounted()) {
+        printk(KERN_INFO "poweroff_hook: SD card unmounted successfully after %d attempts\n", attempt + 1);
+        write_debug_marker("UNMOUNT_SDCARD_SUCCESS");
+        return 0;
+    }
+    write_debug_marker("UNMOUNT_SDCARD_STILL_MOUNTED");
+    report_sdcard_blockers();
+
+    if (ret == -ETIMEDOUT) {
+        printk(KERN_ERR "poweroff_hook: SD card umount stalled, giving up on retries\n");
+        write_debug_marker("UNMOUNT_SDCARD_STALLED");
+        return -ETIMEDOUT;
+    }
+    return -EBUSY;
+}
+
+/*
+ * Stage: final sync and block-level flush of the unmounted card. Runs after
+ * kill_all, so the last holders of the lazily detached card are gone.
+ */
+static int stage_flush_sdcard(int attempt)
+{
+    char *argv_sync[] = { "/bin/sync", NULL };
+    int ret;
+
+    printk(KERN_INFO "poweroff_hook: Final sync\n");
+    write_debug_marker("UNMOUNT_FINAL_SYNC_START");
+    ret = run_helper(argv_sync, helper_timeout_ms);
+    printk(KERN_INFO "poweroff_hook: final sync returned: %d\n", ret);
+    write_debug_marker("UNMOUNT_FINAL_SYNC_DONE");
+
+    /* Durability comes from the block-level flush, not from sleeping */
+    return flush_sdcard_blockdev(true);
+}
+
+/*
+ * Execute AXP717/AXP2202 PMIC clean poweroff sequence (safe minimal version).
+ * Runs the sequence table selected at load; the last step is the trigger.
+ */
+static void execute_axp2202_poweroff(void)
+{
+    const struct pmic_variant *v = pmic_variant;
+    const struct pmic_step *step;
+    const struct pmic_step *trigger;
+    char marker_msg[256];
+    s16 step_ret[HISTORY_PMIC_STEPS] = { 0 };
+    u32 pmic_us = 0;
+    int len, i, ret;
+    ktime_t t;
+
+    /* Unknown PMIC: leave it alone, the caller's kernel_power_off() follows */
+    if (!v) {
+        printk(KERN_ERR "poweroff_hook: No known PMIC, skipping the clean cutoff\n");
+        write_debug_marker("PMIC_UNSUPPORTED");
+        save_shutdown_record(NULL, 0, 0);
+        return;
+    }
+    trigger = &v->steps[v->nsteps - 1];
+
+    printk(KERN_INFO "poweroff_hook: ===== Starting %s Clean Poweroff Sequence =====\n", v->name);
+    write_debug_marker("PMIC_SEQUENCE_START");
+
+    /* All steps before the trigger are bus-bound; their timings are recorded
+     * in one marker afterwards instead of an fsync'd marker per step */
+    len = snprintf(marker_msg, sizeof(marker_msg), "PMIC_STEPS");
+    for (i = 0; i < v->nsteps - 1; i++) {
+        s64 us;
+
+        step = &v->steps[i];
+        t = ktime_get();
+        ret = step->write(step->reg, step->values, step->count);
+        us = ktime_us_delta(ktime_get(), t);
+        pmic_us += us;
+        if (i < HISTORY_PMIC_STEPS)
+            step_ret[i] = ret;
+        if (ret < 0)
+            printk(KERN_INFO "poweroff_hook: Step %s (0x%02x+%d) failed, error=%d\n",
+                   step->name, step->reg, step->count, ret);
+        printk(KERN_INFO "poweroff_hook: Step %d/%d - %s (0x%02x+%d) in %lldus\n",
+               i + 1, v->nsteps, step->name, step->reg, step->count, us);
+        if (len < sizeof(marker_msg))
+            len += snprintf(marker_msg + len, sizeof(marker_msg) - len, " %s=%lldus/%d", step->name, us, ret);
+        if (step->delay_ms)
+            msleep(step->delay_ms);
+    }
+    if (len < sizeof(marker_msg))
+        snprintf(marker_msg + len, sizeof(marker_msg) - len, " errors=%u", pmic_errors);
+    write_debug_marker(marker_msg);
+    save_shutdown_record(step_ret, min(v->nsteps - 1, HISTORY_PMIC_STEPS), pmic_us);
+
+    /* Final step: TRIGGER SOFTWARE POWER-OFF */
+    printk(KERN_INFO "poweroff_hook: Step %d/%d - TRIGGERING SOFTWARE POWER-OFF (0x%02x)\n",
+           v->nsteps, v->nsteps, trigger->reg);
+    write_debug_marker("STEP4_TRIGGER_POWEROFF");
+    t = ktime_get();
+    ret = trigger->write(trigger->reg, trigger->values, trigger->count);
+    if (ret < 0)
+        printk(KERN_INFO "poweroff_hook: CRITICAL - PMIC poweroff trigger failed! error=%d\n", ret);
+    else
+        printk(KERN_INFO "poweroff_hook: PMIC SOFTWARE POWER-OFF TRIGGERED (0x%02x=0x%02x) in %lldus\n",
+               trigger->reg, trigger->values[0], ktime_us_delta(ktime_get(), t));
+    write_debug_marker("STEP4_COMPLETE");
+    
+    /* Power should cut almost immediately after this command.
+     * If we reach here, give PMIC a moment to latch the shutdown. */
+    msleep(1000);
+
+    printk(KERN_INFO "poweroff_hook: ===== %s Poweroff Sequence Complete =====\n", v->name);
+    write_debug_marker("PMIC_SEQUENCE_COMPLETE");
+}
+
+/*
+ * Claim the final cutoff. Returns false if the other path already owns it,
+ * in which case the caller must not touch the PMIC or call kernel_power_off().
+ */
+static bool claim_cutoff(void)
+{
+    return atomic_cmpxchg(&cutoff_claimed, 0, 1) == 0;
+}
+
+/*
+ * The sequence missed its deadline: sync if possible, then cut power
+ */
+static void shutdown_deadline_work_fn(struct kthread_work *work)
+{
+    char *argv_sync[] = { "/bin/sync", NULL };
+    int ret;
+
+    if (active_dry_run) {
+        printk(KERN_WARNING "poweroff_hook: Shutdown deadline of %ums expired during dry run\n",
+               armed_budget_ms);
+        write_debug_marker("DEADLINE_EXPIRED_DRY_RUN");
+        return;
+    }
+
+    if (!claim_cutoff())
+        return;
+
+    printk(KERN_ERR "poweroff_hook: Shutdown deadline of %ums expired, forcing PMIC cutoff\n",
+           armed_budget_ms);
+    write_debug_marker("DEADLINE_EXPIRED");
+    shutdown_path |= HISTORY_DEADLINE;
+
+    ret = run_helper(argv_sync, DEADLINE_SYNC_TIMEOUT_MS);
+    printk(KERN_INFO "poweroff_hook: deadline sync returned: %d\n", ret);
+
+    if (shutdown_action == ACTION_REBOOT) {
+        write_debug_marker("DEADLINE_KERNEL_RESTART");
+        save_shutdown_record(NULL, 0, 0);
+        kernel_restart(NULL);
+    }
+
+    execute_axp2202_poweroff();
+
+    printk(KERN_INFO "poweroff_hook: Calling kernel_power_off() (deadline path)\n");
+    write_debug_marker("DEADLINE_KERNEL_POWEROFF");
+    kernel_power_off();
+}
+
+static enum hrtimer_restart shutdown_deadline_fn(struct hrtimer *timer)
+{
+    /* Hard IRQ context: the cutoff itself needs to sleep. The worker is
+     * SCHED_FIFO above the boosted sequence and helpers, so a busy RT
+     * helper cannot hold the watchdog off until RT throttling lets CFS in */
+    kthread_queue_work(deadline_worker, &deadline_work);
+    return HRTIMER_NORESTART;
+}
+
+/* Re-arming an armed deadline replaces it; the budget counts from the signal */
+static void arm_shutdown_deadline(unsigned int budget_ms)
+{
+    if (!shutdown_budget_ms)
+        return;
+
+    armed_budget_ms = budget_ms;
+    hrtimer_start(&deadline_timer, ktime_add(signal_time, ms_to_ktime(budget_ms)), HRTIMER_MODE_ABS);
+    printk(KERN_INFO "poweroff_hook: Shutdown deadline armed: %ums\n", budget_ms);
+}
+
+/*
+ * Called by the sequence right before its own cutoff. If the watchdog got
+ * there first, park this thread and let the watchdog finish.
+ */
+static void disarm_shutdown_deadline_or_park(void)
+{
+    hrtimer_cancel(&deadline_timer);
+    if (claim_cutoff())
+        return;
+
+    printk(KERN_WARNING "poweroff_hook: Deadline watchdog owns the cutoff, parking sequence\n");
+    write_debug_marker("SEQUENCE_PARKED");
+    while (1)
+        msleep(1000);
+}
+
+/*
+ * Panic: there is no sleeping and no filesystem any more. The stage goes to
+ * the kernel log, which pstore keeps across the reset. The cutoff runs from
+ * panic()'s final loop through panic_blink, installed by a panic kmsg
+ * dumper: it comes after every dumper, pstore included, and the wait is
+ * panic()'s own mdelay loop rather than a busy-wait inside the dumper.
+ */
+static ktime_t panic_time;
+static long (*prev_panic_blink)(int state);
+
+/* Called from panic()'s final loop, about five times a second */
+static long poweroff_hook_panic_blink(int state)
+{
+    static bool cut;
+    long delay = prev_panic_blink ? prev_panic_blink(state) : 0;
+
+    if (!cut && ktime_to_ms(ktime_sub(ktime_get(), panic_time)) >= panic_cutoff_ms) {
+        cut = true;
+        axp2202_poweroff_atomic();
+    }
+    return delay;
+}
+
+static int poweroff_hook_panic_notify(struct notifier_block *nb, unsigned long event, void *data)
+{
+    if (panic_cutoff_ms >= 0 && panic_timeout == 0)
+        printk(KERN_EMERG "poweroff_hook: panic at stage %s, PMIC cutoff in %dms\n",
+               last_stage, panic_cutoff_ms);
+    else
+        printk(KERN_EMERG "poweroff_hook: panic at stage %s\n", last_stage);
+    return NOTIFY_DONE;
+}
+
+static void poweroff_hook_panic_dump(struct kmsg_dumper *dumper, enum kmsg_dump_reason reason)
+{
+    /* A panic_timeout means the kernel reboots on its own */
+    if (reason != KMSG_DUMP_PANIC || panic_cutoff_ms < 0 || panic_timeout != 0)
+        return;
+
+    panic_time = ktime_get();
+    prev_panic_blink = panic_blink;
+    panic_blink = poweroff_hook_panic_blink;
+}
+
+/*
+ * Oops: the kernel keeps running, so if asked, let the deadline watchdog
+ * sync and cut power from a workqueue. An oops in the shutdown thread
+ * itself is already covered by the armed deadline.
+ */
+static int poweroff_hook_die_notify(struct notifier_block *nb, unsigned long event, void *data)
+{
+    if (event != DIE_OOPS)
+        return NOTIFY_DONE;
+
+    printk(KERN_EMERG "poweroff_hook: oops at stage %s\n", last_stage);
+    if (!oops_cutoff || panic_cutoff_ms < 0 || atomic_read(&cutoff_claimed) ||
+        hrtimer_active(&deadline_timer))
+        return NOTIFY_DONE;
+
+    armed_budget_ms = panic_cutoff_ms;
+    hrtimer_start(&deadline_timer, ms_to_ktime(panic_cutoff_ms), HRTIMER_MODE_REL);
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block panic_nb = {
+    .notifier_call = poweroff_hook_panic_notify,
+    /* Last in the chain: everyone else has reported by the time the stage is logged */
+    .priority = INT_MIN,
+};
+
+static struct notifier_block die_nb = {
+    .notifier_call = poweroff_hook_die_notify,
+};
+
+static struct kmsg_dumper panic_dumper = {
+    .dump = poweroff_hook_panic_dump,
+    .max_reason = KMSG_DUMP_PANIC,
+};
+
+/*
+ * Evaluate the battery after a power_supply change. Runs from a workqueue
+ * because the notifier chain is atomic and property reads may sleep.
+ */
+static void battery_work_fn(struct work_struct *work)
+{
+    union power_supply_propval status, cap = { .intval = -1 }, volt = { .intval = -1000 };
+    struct power_supply *psy;
+    bool low_cap, low_volt;
+    char marker[96];
+
+    if (battery_critical)
+        return;
+
+    psy = get_battery_supply();
+    if (!psy)
+        return;
+    if (power_supply_get_property(psy, POWER_SUPPLY_PROP_STATUS, &status) ||
+        status.intval != POWER_SUPPLY_STATUS_DISCHARGING) {
+        power_supply_put(psy);
+        return;
+    }
+    low_cap = critical_capacity > 0 &&
+              !power_supply_get_property(psy, POWER_SUPPLY_PROP_CAPACITY, &cap) &&
+              cap.intval <= critical_capacity;
+    low_volt = critical_voltage_mv > 0 &&
+               !power_supply_get_property(psy, POWER_SUPPLY_PROP_VOLTAGE_NOW, &volt) &&
+               volt.intval / 1000 <= critical_voltage_mv;
+    power_supply_put(psy);
+
+    if (!low_cap && !low_volt)
+        return;
+
+    printk(KERN_WARNING "poweroff_hook: Battery critical, starting shutdown sequence\n");
+    snprintf(marker, sizeof(marker), "BATTERY_CRITICAL cap=%d vbat=%dmV",
+             cap.intval, volt.intval / 1000);
+    write_debug_marker(marker);
+
+    battery_critical = true;
+    wake_up(&monitor_wq);
+}
+
+static int poweroff_hook_psy_notify(struct notifier_block *nb, unsigned long event, void *data)
+{
+    struct power_supply *psy = data;
+
+    if (event == PSY_EVENT_PROP_CHANGED && psy->desc->type == POWER_SUPPLY_TYPE_BATTERY &&
+        (critical_capacity > 0 || critical_voltage_mv > 0))
+        schedule_work(&battery_work);
+    return NOTIFY_OK;
+}
+
+static struct notifier_block psy_nb = {
+    .notifier_call = poweroff_hook_psy_notify,
+};
+
+/*
+ * Shutdown state machine. Each stage runs once (or up to its retry count),
+ * has a time budget and a failure policy, and records its outcome for
+ * /proc/poweroff_hook/status:
+ *   STAGE_SKIP      a failure is recorded and the sequence moves on
+ *   STAGE_RETRY     rerun while attempts and budget remain, then escalate
+ *   STAGE_ESCALATE  jump straight to the stages every path must run
+ * Stages from STAGE_KILL_ALL on are never skipped, so every exit path
+ * flushes the card and ends in the PMIC cutoff. The flush comes after
+ * kill_all: the lazy SD detach keeps the filesystem alive until its last
+ * user is dead.
+ */
+enum shutdown_stage_id {
+    STAGE_PREPARE,
+    STAGE_KILL_SDCARD_USERS,
+    STAGE_UNMOUNT_PREPARE,
+    STAGE_UNMOUNT_SDCARD,
+    STAGE_KILL_ALL,
+    STAGE_FLUSH_SDCARD,
+    STAGE_PMIC_CUTOFF,
+    NR_SHUTDOWN_STAGES
+};
+
+enum stage_policy { STAGE_SKIP, STAGE_RETRY, STAGE_ESCALATE };
+
+/* What a stage does to the device, for dry runs */
+enum stage_kind { STAGE_HARMLESS, STAGE_DISRUPTIVE, STAGE_FINAL };
+
+/*
+ * CPU frequency a stage runs at. Work stages (the /proc scans, sync,
+ * unmount) are pinned to the top of the current policy range, the stages
+ * that mostly sleep to the hardware minimum. prepare keeps the governor:
+ * it is where the thermal check runs.
+ */
+enum cpufreq_pin { CPUFREQ_PIN_NONE, CPUFREQ_PIN_MAX, CPUFREQ_PIN_MIN };
+
+static bool shutdown_cpufreq = true;
+module_param(shutdown_cpufreq, bool, 0644);
+MODULE_PARM_DESC(shutdown_cpufreq, "Pin CPU frequency per shutdown stage: max for work, min for waits (default true)");
+
+static bool offline_cpus = true;
+module_param(offline_cpus, bool, 0644);
+MODULE_PARM_DESC(offline_cpus, "Take secondary CPUs offline before the PMIC cutoff, except shutdown_cpu (default true)");
+
+static int cpufreq_pin = CPUFREQ_PIN_NONE;
+
+/*
+ * Policy notifier: clamp every policy update while a pin is active. The
+ * max pin raises min to the current max rather than cpuinfo.max_freq, so
+ * user and thermal limits still apply.
+ */
+static int poweroff_hook_cpufreq_notify(struct notifier_block *nb, unsigned long event, void *data)
+{
+    struct cpufreq_policy *policy = data;
+
+    if (event != CPUFREQ_ADJUST)
+        return NOTIFY_DONE;
+
+    switch (cpufreq_pin) {
+    case CPUFREQ_PIN_MAX:
+        cpufreq_verify_within_limits(policy, policy->max, policy->max);
+        break;
+    case CPUFREQ_PIN_MIN:
+        cpufreq_verify_within_limits(policy, policy->cpuinfo.min_freq, policy->cpuinfo.min_freq);
+        break;
+    default:
+        return NOTIFY_DONE;
+    }
+    return NOTIFY_OK;
+}
+
+static struct notifier_block cpufreq_nb = {
+    .notifier_call = poweroff_hook_cpufreq_notify,
+};
+
+static void set_cpufreq_pin(int pin)
+{
+    int cpu;
+
+    if (pin == cpufreq_pin || (pin != CPUFREQ_PIN_NONE && !shutdown_cpufreq))
+        return;
+    cpufreq_pin = pin;
+    for_each_online_cpu(cpu)
+        cpufreq_update_policy(cpu);
+}
+
+/*
+ * Before the PMIC cutoff: nothing is left for the secondary cores to do,
+ * so take them offline and let the cutoff run on a single core
+ */
+static void offline_secondary_cpus(void)
+{
+    char marker[64];
+    ktime_t start;
+    int cpu, count = 0;
+
+    if (!offline_cpus)
+        return;
+
+    start = ktime_get();
+    for_each_online_cpu(cpu) {
+        /* Keep the CPU the shutdown thread is pinned to */
+        if (cpu == 0 || cpu == shutdown_cpu)
+            continue;
+        if (cpu_down(cpu))
+            printk(KERN_WARNING "poweroff_hook: Could not take CPU%d offline\n", cpu);
+        else
+            count++;
+    }
+    snprintf(marker, sizeof(marker), "CPU_OFFLINE count=%d time=%lldus",
+             count, ktime_to_us(ktime_sub(ktime_get(), start)));
+    write_debug_marker(marker);
+}
+
+enum stage_outcome {
+    OUTCOME_PENDING,
+    OUTCOME_RUNNING,
+    OUTCOME_OK,
+    OUTCOME_OVER_BUDGET,
+    OUTCOME_FAILED,
+    OUTCOME_SKIPPED,
+};
+
+static const char * const outcome_names[] = {
+    [OUTCOME_PENDING] = "pending",
+    [OUTCOME_RUNNING] = "running",
+    [OUTCOME_OK] = "ok",
+    [OUTCOME_OVER_BUDGET] = "over_budget",
+    [OUTCOME_FAILED] = "failed",
+    [OUTCOME_SKIPPED] = "skipped",
+};
+
+struct shutdown_stage {
+    const char *name;
+    int (*run)(int attempt);
+    void (*enter)(void);
+    void (*exit)(int ret);
+    enum stage_policy policy;
+    int retries;
+    enum stage_kind kind;
+    enum cpufreq_pin cpufreq;
+    /* Recorded outcome */
+    enum stage_outcome outcome;
+    int ret;
+    int attempts;
+    s64 elapsed_ms;
+};
+
+/* Per-stage budgets, tunable at runtime; together they should fit in shutdown_budget_ms */
+static unsigned int stage_budget_ms[NR_SHUTDOWN_STAGES] = {
+    500,    /* prepare */
+    2000,   /* kill_sdcard_users */
+    5000,   /* unmount_prepare */
+    5000,   /* unmount_sdcard */
+    2500,   /* kill_all */
+    1500,   /* flush_sdcard */
+    1500,   /* pmic_cutoff */
+};
+module_param_array(stage_budget_ms, uint, NULL, 0644);
+MODULE_PARM_DESC(stage_budget_ms, "Per-stage budgets in ms: prepare,kill_sdcard_users,unmount_prepare,unmount_sdcard,kill_all,flush_sdcard,pmic_cutoff");
+
+/* /proc/poweroff_hook: runtime view of the sequence */
+static struct proc_dir_entry *proc_dir;
+
+/* Stage being run, -1 before the signal */
+static int current_stage = -1;
+
+/*
+ * Progress for /proc/poweroff_hook/wait: sequence_gen counts sequences
+ * started since load, sequence_result is where the last one ended up.
+ */
+enum sequence_result { SEQ_IDLE, SEQ_RUNNING, SEQ_DONE };
+
+static int sequence_result = SEQ_IDLE;
+static unsigned int sequence_gen;
+static bool wait_unloading;
+static DECLARE_WAIT_QUEUE_HEAD(progress_wq);
+
+/* How long a wait reader gives the monitor to pick up the signal file */
+#define WAIT_START_TIMEOUT_MS 2000
+
+static void publish_progress(int result)
+{
+    sequence_result = result;
+    wake_up_all(&progress_wq);
+}
+
+static void publish_stage(int id)
+{
+    current_stage = id;
+    wake_up_all(&progress_wq);
+}
+
+/* Ends in the cutoff stage, so it is defined after it */
+static void thermal_fast_shutdown(int temp_dc);
+
+/*
+ * Stage: telemetry, power quiesce and the thermal check (which may take
+ * over and not return)
+ */
+static int stage_prepare(int attempt)
+{
+    struct timespec ts;
+    struct tm tm;
+    char log_msg[256];
+
+    record_battery_sample("PRE_KILL");
+    /* Joined before the card is touched, see stage_unmount_prepare() */
+    if (quiesce_power && !active_dry_run && shutdown_action == ACTION_POWEROFF)
+        async_schedule_domain(async_quiesce_power, NULL, &shutdown_domain);
+
+    if (hot_threshold_dc > 0) {
+        int temp_dc;
+
+        if (read_shutdown_temp(&temp_dc) == 0 && temp_dc >= hot_threshold_dc) {
+            if (!active_dry_run)
+                thermal_fast_shutdown(temp_dc);
+            snprintf(log_msg, sizeof(log_msg), "THERMAL_FAST_PATH_DRY_RUN temp=%d threshold=%d",
+                     temp_dc, hot_threshold_dc);
+            write_debug_marker(log_msg);
+        }
+    }
+
+    /* Get timestamp for logging */
+    getnstimeofday(&ts);
+    time_to_tm(ts.tv_sec, 0, &tm);
+    
+    snprintf(log_msg, sizeof(log_msg),
+             "=== PowerOff Signal Received ===\n"
+             "Timestamp: %04ld-%02d-%02d %02d:%02d:%02d UTC\n",
+             tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+             tm.tm_hour, tm.tm_min, tm.tm_sec);
+    
+    write_log(log_msg);
+    printk(KERN_INFO "poweroff_hook: ============================================\n");
+    printk(KERN_INFO "poweroff_hook: PowerOff signal received from NextUI\n");
+    printk(KERN_INFO "poweroff_hook: Beginning clean shutdown sequence\n");
+    printk(KERN_INFO "poweroff_hook: ============================================\n");
+    return 0;
+}
+
+/* Stage: kill processes that hold files on the SD card */
+static int stage_kill_sdcard_users(int attempt)
+{
+    msleep(500);
+    kill_sdcard_users();
+    return 0;
+}
+
+/* Stage: kill all user processes (but not kernel threads), unless the swap stage already had to */
+static int stage_kill_all(int attempt)
+{
+    if (!user_processes_killed)
+        kill_all_processes();
+    return 0;
+}
+
+static void stage_pmic_cutoff_enter(void)
+{
+    record_battery_sample("PRE_TRIGGER");
+    /* cpu_down() can stall on the hotplug lock; keep the watchdog armed across it */
+    offline_secondary_cpus();
+    disarm_shutdown_deadline_or_park();
+}
+
+/*
+ * Stage: end the sequence with the requested action. Returning at all
+ * means the device is still running.
+ */
+static int stage_pmic_cutoff(int attempt)
+{
+    switch (shutdown_action) {
+    case ACTION_REBOOT:
+        printk(KERN_INFO "poweroff_hook: Calling kernel_restart()\n");
+        write_debug_marker("KERNEL_RESTART");
+        save_shutdown_record(NULL, 0, 0);
+        kernel_restart(NULL);
+        break;
+    case ACTION_HALT:
+        printk(KERN_INFO "poweroff_hook: Calling kernel_halt()\n");
+        write_debug_marker("KERNEL_HALT");
+        save_shutdown_record(NULL, 0, 0);
+        kernel_halt();
+        break;
+    default:
+        execute_axp2202_poweroff();
+        break;
+    }
+    return -ETIMEDOUT;
+}
+
+/*
+ * Thermal fast path: the battery is already hot, so skip the retries and
+ * sleeps of the safe path. Kill the card's users and freeze the rest of
+ * userspace, sync and write-protect the SD card, flush it, then end with
+ * the requested action. Progress is
+ * published as the stages these steps stand in for. Does not return.
+ */
+static void thermal_fast_shutdown(int temp_dc)
+{
+    char *argv_stop[] = { "/bin/busybox", "kill", "-STOP", "-1", NULL };
+    char *argv_remount[] = { "/bin/busybox", "mount", "-o", "remount,ro", SDCARD_PATH, NULL };
+    char marker[128];
+    struct path p;
+    int stop_ret, sync_ret = -ENOENT, remount_ret;
+    ktime_t start = ktime_get();
+
+    printk(KERN_WARNING "poweroff_hook: Battery at %d.%dC, taking thermal fast path\n",
+           temp_dc / 10, abs(temp_dc % 10));
+    snprintf(marker, sizeof(marker), "THERMAL_FAST_PATH temp=%d threshold=%d budget=%ums",
+             temp_dc, hot_threshold_dc, hot_budget_ms);
+    write_debug_marker(marker);
+    shutdown_path |= HISTORY_THERMAL;
+    /* Only ever shortens the deadline armed at the signal */
+    if (hot_budget_ms < armed_budget_ms)
+        arm_shutdown_deadline(hot_budget_ms);
+
+    /* Card users are killed: a read-only remount is refused while a file is open for write */
+    publish_stage(STAGE_KILL_SDCARD_USERS);
+    kill_sdcard_users();
+    msleep(200);
+    /* Everyone else is stopped, not killed: nothing gets to dirty the card again, and no exit work runs */
+    stop_ret = run_helper(argv_stop, helper_timeout_ms);
+
+    publish_stage(STAGE_UNMOUNT_SDCARD);
+    capture_sdcard_dev();
+    sd_logging_enabled = false;
+    if (kern_path(SDCARD_PATH, LOOKUP_FOLLOW, &p) == 0) {
+        if (p.dentry == p.mnt->mnt_root) {
+            struct super_block *sb = p.mnt->mnt_sb;
+
+            down_read(&sb->s_umount);
+            sync_ret = sync_filesystem(sb);
+            up_read(&sb->s_umount);
+        }
+        path_put(&p);
+    }
+
+    remount_ret = run_helper(argv_remount, helper_timeout_ms);
+    if (remount_ret)
+        printk(KERN_ERR "poweroff_hook: Thermal path could not remount the SD card read-only: %d\n",
+               remount_ret);
+    publish_stage(STAGE_FLUSH_SDCARD);
+    /* Remounted, not unmounted: the superblock stays */
+    flush_sdcard_blockdev(false);
+
+    snprintf(marker, sizeof(marker), "THERMAL_FAST_READY stop=%d sync=%d remount_ro=%d%s time=%lldms",
+             stop_ret, sync_ret, remount_ret, remount_ret ? " REMOUNT_RO_FAILED" : "",
+             ktime_to_ms(ktime_sub(ktime_get(), start)));
+    write_debug_marker(marker);
+
+    /* Same end as the safe path: reboot and halt stay reboot and halt */
+    publish_stage(STAGE_PMIC_CUTOFF);
+    stage_pmic_cutoff_enter();
+    stage_pmic_cutoff(0);
+
+    printk(KERN_INFO "poweroff_hook: Calling kernel_power_off() (thermal fast path)\n");
+    kernel_power_off();
+    while (1) {
+        cpu_relax();
+    }
+}
+
+static struct shutdown_stage shutdown_stages[NR_SHUTDOWN_STAGES] = {
+    [STAGE_PREPARE] = {
+        .name = "prepare", .run = stage_prepare, .policy = STAGE_SKIP,
+    },
+    [STAGE_KILL_SDCARD_USERS] = {
+        .name = "kill_sdcard_users", .run = stage_kill_sdcard_users, .policy = STAGE_SKIP,
+        .kind = STAGE_DISRUPTIVE, .cpufreq = CPUFREQ_PIN_MAX,
+    },
+    [STAGE_UNMOUNT_PREPARE] = {
+        .name = "unmount_prepare", .run = stage_unmount_prepare, .policy = STAGE_SKIP,
+        .kind = STAGE_DISRUPTIVE, .cpufreq = CPUFREQ_PIN_MAX,
+    },
+    [STAGE_UNMOUNT_SDCARD] = {
+        .name = "unmount_sdcard", .run = stage_unmount_sdcard, .policy = STAGE_RETRY, .retries = 2,
+        .kind = STAGE_DISRUPTIVE, .cpufreq = CPUFREQ_PIN_MAX,
+    },
+    [STAGE_KILL_ALL] = {
+        .name = "kill_all", .run = stage_kill_all, .policy = STAGE_SKIP,
+        .kind = STAGE_DISRUPTIVE, .cpufreq = CPUFREQ_PIN_MIN,
+    },
+    [STAGE_FLUSH_SDCARD] = {
+        .name = "flush_sdcard", .run = stage_flush_sdcard, .policy = STAGE_SKIP,
+        .kind = STAGE_DISRUPTIVE, .cpufreq = CPUFREQ_PIN_MAX,
+    },
+    [STAGE_PMIC_CUTOFF] = {
+        .name = "pmic_cutoff", .run = stage_pmic_cutoff, .enter = stage_pmic_cutoff_enter,
+        .policy = STAGE_SKIP, .kind = STAGE_FINAL, .cpufreq = CPUFREQ_PIN_MIN,
+    },
+};
+
+/*
+ * Sleep inside a work stage at the minimum frequency, then go back to the
+ * stage's own pin. Secondary CPUs stay online: the stage's helpers run
+ * between the waits, and hotplug costs more than the wait saves.
+ */
+static void stage_msleep(unsigned int ms)
+{
+    set_cpufreq_pin(CPUFREQ_PIN_MIN);
+    msleep(ms);
+    if (current_stage >= 0 && current_stage < NR_SHUTDOWN_STAGES)
+        set_cpufreq_pin(shutdown_stages[current_stage].cpufreq);
+}
+
+/*
+ * A skippable stage is only started if, after its own budget, the
+ * mandatory stages still fit before the deadline watchdog would fire
+ */
+static bool stage_fits_budget(int id)
+{
+    s64 needed = stage_budget_ms[id];
+    int i;
+
+    if (!shutdown_budget_ms || id >= STAGE_KILL_ALL)
+        return true;
+    for (i = STAGE_KILL_ALL; i < NR_SHUTDOWN_STAGES; i++)
+        needed += stage_budget_ms[i];
+    return ktime_to_ms(ktime_sub(ktime_get(), signal_time)) + needed <= shutdown_budget_ms;
+}
+
+static bool stage_skipped_by_dry_run(int id)
+{
+    switch (shutdown_stages[id].kind) {
+    case STAGE_DISRUPTIVE:
+        return active_dry_run == DRY_RUN_SAFE;
+    case STAGE_FINAL:
+        return active_dry_run != 0;
+    default:
+        return false;
+    }
+}
+
+static void run_shutdown_stages(void)
+{
+    char marker[128];
+    int id = 0, i;
+
+    for (i = 0; i < NR_SHUTDOWN_STAGES; i++) {
+        shutdown_stages[i].outcome = OUTCOME_PENDING;
+        shutdown_stages[i].ret = 0;
+        shutdown_stages[i].attempts = 0;
+        shutdown_stages[i].elapsed_ms = 0;
+    }
+
+    while (id < NR_SHUTDOWN_STAGES) {
+        struct shutdown_stage *st = &shutdown_stages[id];
+        ktime_t start;
+        int ret;
+
+        publish_stage(id);
+        if (stage_skipped_by_dry_run(id)) {
+            st->outcome = OUTCOME_SKIPPED;
+            snprintf(marker, sizeof(marker), "STAGE_SKIPPED %s dry_run=%d", st->name, active_dry_run);
+            write_debug_marker(marker);
+            id++;
+            continue;
+        }
+        if (!stage_fits_budget(id)) {
+            st->outcome = OUTCOME_SKIPPED;
+            st->ret = -ETIME;
+            snprintf(marker, sizeof(marker), "STAGE_SKIPPED %s no_budget", st->name);
+            write_debug_marker(marker);
+            id++;
+            continue;
+        }
+
+        snprintf(marker, sizeof(marker), "STAGE_ENTER %s budget=%ums", st->name, stage_budget_ms[id]);
+        write_debug_marker(marker);
+        st->outcome = OUTCOME_RUNNING;
+        set_cpufreq_pin(st->cpufreq);
+        if (st->enter)
+            st->enter();
+
+        start = ktime_get();
+        for (st->attempts = 1; ; st->attempts++) {
+            ret = st->run(st->attempts - 1);
+            st->elapsed_ms = ktime_to_ms(ktime_sub(ktime_get(), start));
+            if (!ret || st->policy != STAGE_RETRY || st->attempts > st->retries ||
+                ret == -ETIMEDOUT || st->elapsed_ms >= stage_budget_ms[id])
+                break;
+        }
+        st->ret = ret;
+        if (ret)
+            st->outcome = OUTCOME_FAILED;
+        else if (st->elapsed_ms > stage_budget_ms[id])
+            st->outcome = OUTCOME_OVER_BUDGET;
+        else
+            st->outcome = OUTCOME_OK;
+        if (st->exit)
+            st->exit(ret);
+
+        snprintf(marker, sizeof(marker), "STAGE_EXIT %s outcome=%s ret=%d attempts=%d time=%lldms",
+                 st->name, outcome_names[st->outcome], ret, st->attempts, st->elapsed_ms);
+        write_debug_marker(marker);
+
+        if (ret && st->policy != STAGE_SKIP && id < STAGE_KILL_ALL) {
+            printk(KERN_ERR "poweroff_hook: Stage %s failed (%d), escalating to cutoff\n", st->name, ret);
+            for (i = id + 1; i < STAGE_KILL_ALL; i++)
+                shutdown_stages[i].outcome = OUTCOME_SKIPPED;
+            shutdown_path |= HISTORY_ESCALATED;
+            snprintf(marker, sizeof(marker), "STAGE_ESCALATE from=%s", st->name);
+            write_debug_marker(marker);
+            id = STAGE_KILL_ALL;
+            continue;
+        }
+        id++;
+    }
+    current_stage = NR_SHUTDOWN_STAGES;
 }
 
 /*
- * Write log entry (best effort, may fail if SD card unmounted)
+ * One shutdown, as kept in HISTORY_PATH. Stage fields are indexed by
+ * shutdown_stage_id; pmic_ret holds the PMIC steps before the trigger.
  */
-static void write_log(const char *message)
+struct shutdown_record {
+    u32 magic;
+    u32 seq;
+    s64 time;
+    u32 total_ms;
+    u32 pmic_us;
+    u32 stage_ms[NR_SHUTDOWN_STAGES];
+    u8 stage_attempts[NR_SHUTDOWN_STAGES];
+    u8 stage_outcome[NR_SHUTDOWN_STAGES];
+    u8 action;
+    u8 path;
+    s16 pmic_ret[HISTORY_PMIC_STEPS];
+    u16 pmic_errors;
+};
+
+/* Sequence number of the next record, one past the newest found at load */
+static u32 history_next_seq;
+
+static void save_shutdown_record(const s16 *pmic_ret, int nret, u32 pmic_us)
 {
+    struct shutdown_record rec = {
+        .magic = HISTORY_MAGIC,
+        .seq = history_next_seq,
+        .time = get_seconds(),
+        .total_ms = ktime_to_ms(ktime_sub(ktime_get(), signal_time)),
+        .pmic_us = pmic_us,
+        .action = shutdown_action,
+        .path = shutdown_path,
+        .pmic_errors = min(pmic_errors, 0xffffU),
+    };
     struct file *filp;
     mm_segment_t old_fs;
-    loff_t pos = 0;
-
-    /* Don't write to SD card if logging is disabled (during unmount) */
-    if (!sd_logging_enabled) {
-        return;
-    }
+    loff_t pos = (loff_t)(history_next_seq % HISTORY_SLOTS) * sizeof(rec);
+    int i;
 
-    filp = filp_open(LOG_PATH, O_WRONLY | O_CREAT | O_APPEND, 0644);
-    if (IS_ERR(filp)) {
-        return;
+    for (i = 0; i < NR_SHUTDOWN_STAGES; i++) {
+        rec.stage_ms[i] = clamp_t(s64, shutdown_stages[i].elapsed_ms, 0, U32_MAX);
+        rec.stage_attempts[i] = min(shutdown_stages[i].attempts, 255);
+        rec.stage_outcome[i] = shutdown_stages[i].outcome;
     }
+    for (i = 0; i < nret; i++)
+        rec.pmic_ret[i] = pmic_ret[i];
 
     old_fs = get_fs();
     set_fs(KERNEL_DS);
-    vfs_write(filp, message, strlen(message), &pos);
-    vfs_fsync(filp, 1);
+    filp = filp_open(HISTORY_PATH, O_WRONLY | O_CREAT, 0644);
+    if (!IS_ERR(filp)) {
+        vfs_write(filp, (const char *)&rec, sizeof(rec), &pos);
+        vfs_fsync(filp, 1);
+        filp_close(filp, NULL);
+        history_next_seq++;
+    }
     set_fs(old_fs);
-    filp_close(filp, NULL);
 }
 
-/*
- * Write debug marker to /root/poweroff_hook.log
- * This will be moved to LOG_PATH
- */
-static void write_debug_marker(const char *stage)
+/* Read the whole ring; returns the number of complete records */
+static int load_shutdown_history(struct shutdown_record *recs)
 {
-    struct file *marker_filp;
+    struct file *filp;
     mm_segment_t old_fs;
     loff_t pos = 0;
-    char msg[128];
-    
-    snprintf(msg, sizeof(msg), "[%s]\n", stage);
-    
+    size_t size = HISTORY_SLOTS * sizeof(*recs), total = 0;
+    ssize_t n;
+
+    filp = filp_open(HISTORY_PATH, O_RDONLY, 0);
+    if (IS_ERR(filp))
+        return 0;
+
     old_fs = get_fs();
     set_fs(KERNEL_DS);
-    marker_filp = filp_open("/root/poweroff_hook.log", O_WRONLY | O_CREAT | O_APPEND, 0644);
-    if (!IS_ERR(marker_filp)) {
-        vfs_write(marker_filp, msg, strlen(msg), &pos);
-        vfs_fsync(marker_filp, 1);
-        filp_close(marker_filp, NULL);
+    while (total < size) {
+        n = vfs_read(filp, (char *)recs + total, size - total, &pos);
+        if (n <= 0)
+            break;
+        total += n;
     }
     set_fs(old_fs);
-    
-    printk(KERN_INFO "poweroff_hook: DEBUG MARKER: %s\n", stage);
+    filp_close(filp, NULL);
+
+    return total / sizeof(*recs);
 }
 
-/*
- * Kill all user-space processes safely via usermode helper
- * Avoids kernel process list traversal issues
- */
-static void kill_all_processes(void)
+static int cmp_u32(const void *a, const void *b)
 {
-    char *argv_kill_term[] = { "/bin/busybox", "kill", "-TERM", "-1", NULL };
-    char *argv_kill_kill[] = { "/bin/busybox", "kill", "-KILL", "-1", NULL };
-    int ret;
-
-    printk(KERN_INFO "poweroff_hook: Starting graceful process termination (SIGTERM)\n");
+    u32 x = *(const u32 *)a, y = *(const u32 *)b;
 
-    /* First pass: Send SIGTERM for graceful shutdown */
-    ret = call_usermodehelper(argv_kill_term[0], argv_kill_term, usermode_envp, UMH_WAIT_PROC);
-    printk(KERN_INFO "poweroff_hook: busybox kill -TERM -1 returned: %d\n", ret);
+    return x < y ? -1 : x > y;
+}
 
-    printk(KERN_INFO "poweroff_hook: Sent SIGTERM to all processes, waiting 500ms\n");
-    msleep(500);  /* Give processes time to exit gracefully */
+static u32 median_u32(u32 *vals, int n)
+{
+    sort(vals, n, sizeof(*vals), cmp_u32, NULL);
+    return vals[n / 2];
+}
 
-    /* Second pass: Force kill with SIGKILL */
-    printk(KERN_INFO "poweroff_hook: Force killing remaining processes (SIGKILL)\n");
-    ret = call_usermodehelper(argv_kill_kill[0], argv_kill_kill, usermode_envp, UMH_WAIT_PROC);
-    printk(KERN_INFO "poweroff_hook: busybox kill -KILL -1 returned: %d\n", ret);
+/* Skipped stages and the one still running at save time have no duration */
+static bool history_stage_ran(u8 outcome)
+{
+    return outcome == OUTCOME_OK || outcome == OUTCOME_OVER_BUDGET || outcome == OUTCOME_FAILED;
+}
 
-    printk(KERN_INFO "poweroff_hook: Process termination complete\n");
-    msleep(200);  /* Brief wait for processes to die */
+static bool history_regressed(u32 last, u32 median)
+{
+    return last * 100 > median * HISTORY_REGRESSION_PCT && last - median >= HISTORY_REGRESSION_MIN_MS;
 }
 
 /*
- * Kill any processes that still hold files on /mnt/SDCARD by inspecting /proc/<pid>/fd
+ * At load: compare the newest record against the median of the older ones,
+ * per stage and in total, and write the summary to the log
  */
-static void kill_sdcard_users(void)
+static void report_shutdown_history(void)
 {
-    static char kill_script[] =
-        "for pid_path in /proc/[0-9]*; do "
-            "pid=${pid_path#/proc/}; "
-            "[ \\\"$pid\\\" -le 1 ] && continue; "
-            "for fd in \\\"$pid_path\\\"/fd/*; do "
-                "[ -e \\\"$fd\\\" ] || continue; "
-                "target=$(readlink \\\"$fd\\\" 2>/dev/null) || continue; "
-                "case \\\"$target\\\" in "
-                    "/mnt/SDCARD*) /bin/busybox kill -9 \\\"$pid\\\" 2>/dev/null; continue 2 ;; "
-                "esac; "
-            "done; "
-        "done";
-    char *argv_kill_sdcard[] = { "/bin/sh", "-c", kill_script, NULL };
-    int ret;
+    struct shutdown_record *recs, *last = NULL;
+    char line[256];
+    char rets[HISTORY_PMIC_STEPS * 8] = "-";
+    u32 *vals, median;
+    int i, j, n, count = 0, nvals, nret, len;
+
+    recs = kcalloc(HISTORY_SLOTS, sizeof(*recs), GFP_KERNEL);
+    vals = kcalloc(HISTORY_SLOTS, sizeof(*vals), GFP_KERNEL);
+    if (!recs || !vals)
+        goto out;
+
+    n = load_shutdown_history(recs);
+    for (i = 0; i < n; i++) {
+        if (recs[i].magic != HISTORY_MAGIC)
+            continue;
+        /* Newest by sequence number, allowing for wraparound */
+        if (!last || recs[i].seq - last->seq < U32_MAX / 2)
+            last = &recs[i];
+        count++;
+    }
+    if (!last) {
+        printk(KERN_INFO "poweroff_hook: No shutdown history yet\n");
+        goto out;
+    }
+    history_next_seq = last->seq + 1;
+
+    /* Older records only: the newest is what is being judged */
+    for (i = 0, nvals = 0; i < n; i++)
+        if (recs[i].magic == HISTORY_MAGIC && &recs[i] != last)
+            vals[nvals++] = recs[i].total_ms;
+    median = nvals ? median_u32(vals, nvals) : 0;
+
+    /* Step results in table order; "-" when the steps before the trigger never ran */
+    nret = pmic_variant ? min(pmic_variant->nsteps - 1, HISTORY_PMIC_STEPS) : HISTORY_PMIC_STEPS;
+    for (i = 0, len = 0; last->pmic_us && i < nret; i++)
+        len += scnprintf(rets + len, sizeof(rets) - len, "%s%d", i ? "/" : "", last->pmic_ret[i]);
+
+    snprintf(line, sizeof(line), "HISTORY seq=%u n=%d action=%s path=0x%02x total=%ums median=%ums pmic=%uus pmic_ret=%s errors=%u%s\n",
+             last->seq, count, last->action < ARRAY_SIZE(action_names) ? action_names[last->action] : "?",
+             last->path, last->total_ms, median, last->pmic_us, rets, last->pmic_errors,
+             nvals && history_regressed(last->total_ms, median) ? " REGRESSION" : "");
+    write_log(line);
+    printk(KERN_INFO "poweroff_hook: %s", line);
+
+    for (j = 0; j < NR_SHUTDOWN_STAGES; j++) {
+        if (!history_stage_ran(last->stage_outcome[j]))
+            continue;
+        for (i = 0, nvals = 0; i < n; i++) {
+            if (recs[i].magic != HISTORY_MAGIC || &recs[i] == last)
+                continue;
+            if (history_stage_ran(recs[i].stage_outcome[j]))
+                vals[nvals++] = recs[i].stage_ms[j];
+        }
+        median = nvals ? median_u32(vals, nvals) : 0;
+        snprintf(line, sizeof(line), "HISTORY_STAGE %s last=%ums median=%ums n=%d attempts=%u outcome=%s%s\n",
+                 shutdown_stages[j].name, last->stage_ms[j], median, nvals, last->stage_attempts[j],
+                 outcome_names[last->stage_outcome[j]],
+                 nvals && history_regressed(last->stage_ms[j], median) ? " REGRESSION" : "");
+        write_log(line);
+        printk(KERN_INFO "poweroff_hook: %s", line);
+    }
+out:
+    kfree(vals);
+    kfree(recs);
+}
 
-    ret = call_usermodehelper(argv_kill_sdcard[0], argv_kill_sdcard, usermode_envp, UMH_WAIT_PROC);
-    printk(KERN_INFO "poweroff_hook: procfd kill script returned: %d\n", ret);
+static int status_show(struct seq_file *m, void *v)
+{
+    int i;
+
+    if (current_stage < 0)
+        seq_puts(m, "state: idle\n");
+    else if (current_stage < NR_SHUTDOWN_STAGES)
+        seq_printf(m, "state: running %s\n", shutdown_stages[current_stage].name);
+    else
+        seq_puts(m, "state: done\n");
+    if (current_stage >= 0)
+        seq_printf(m, "elapsed: %lldms of %ums\n",
+                   ktime_to_ms(ktime_sub(ktime_get(), signal_time)), armed_budget_ms);
+    if (current_stage >= 0)
+        seq_printf(m, "action: %s\n", action_names[shutdown_action]);
+    if (active_dry_run)
+        seq_printf(m, "dry_run: %d\n", active_dry_run);
+    seq_printf(m, "last_marker: %s\n", last_stage);
+
+    for (i = 0; i < NR_SHUTDOWN_STAGES; i++) {
+        const struct shutdown_stage *st = &shutdown_stages[i];
+
+        seq_printf(m, "%-18s %-11s ret=%d attempts=%d time=%lldms budget=%ums\n",
+                   st->name, outcome_names[st->outcome], st->ret, st->attempts,
+                   st->elapsed_ms, stage_budget_ms[i]);
+    }
+    return 0;
+}
+
+static int status_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, status_show, NULL);
 }
 
+static const struct file_operations status_fops = {
+    .owner = THIS_MODULE,
+    .open = status_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
 /*
- * Unmount filesystems and disable swap
+ * Parse a trigger payload: whitespace-separated words, "poweroff" (the
+ * default), "reboot" or "halt", and "dryrun" or "dryrun=N" to raise the
+ * dry_run parameter for this run. Unknown words are ignored.
  */
-static void unmount_filesystems(void)
+static void parse_trigger_payload(char *payload, int *action, int *dry)
 {
-    char *argv_sync[] = { "/bin/sync", NULL };
-    char *argv_swapoff[] = { "/usr/sbin/swapoff", "-a", NULL };
-    char *argv_umount_profile[] = { "/bin/umount", "-f", "/etc/profile", NULL };
-    int retry, ret;
-    
-    printk(KERN_INFO "poweroff_hook: Syncing all filesystems\n");
-    write_debug_marker("UNMOUNT_SYNC_START");
-    ret = call_usermodehelper(argv_sync[0], argv_sync, usermode_envp, UMH_WAIT_PROC);
-    printk(KERN_INFO "poweroff_hook: sync returned: %d\n", ret);
-    msleep(100);
-    write_debug_marker("UNMOUNT_SYNC_DONE");
-    
-    printk(KERN_INFO "poweroff_hook: Disabling swap\n");
-    write_debug_marker("UNMOUNT_SWAPOFF_START");
-    ret = call_usermodehelper(argv_swapoff[0], argv_swapoff, usermode_envp, UMH_WAIT_PROC);
-    printk(KERN_INFO "poweroff_hook: swapoff returned: %d\n", ret);
-    write_debug_marker("UNMOUNT_SWAPOFF_DONE");
-    
-    printk(KERN_INFO "poweroff_hook: Unmounting /etc/profile\n");
-    write_debug_marker("UNMOUNT_PROFILE_START");
-    ret = call_usermodehelper(argv_umount_profile[0], argv_umount_profile, usermode_envp, UMH_WAIT_PROC);
-    printk(KERN_INFO "poweroff_hook: umount /etc/profile returned: %d\n", ret);
-    write_debug_marker("UNMOUNT_PROFILE_DONE");
-    
-    /* CRITICAL: Stop writing to SD card before unmounting it! */
-    printk(KERN_INFO "poweroff_hook: Disabling SD card logging\n");
-    write_debug_marker("UNMOUNT_DISABLE_SD_LOGGING");
-    sd_logging_enabled = false;
-    
-    /* Extra sync to flush any pending writes to SD card */
-    printk(KERN_INFO "poweroff_hook: Final SD card sync before unmount\n");
-    write_debug_marker("UNMOUNT_SDCARD_PRE_SYNC");
-    ret = call_usermodehelper(argv_sync[0], argv_sync, usermode_envp, UMH_WAIT_PROC);
-    printk(KERN_INFO "poweroff_hook: pre-unmount sync returned: %d\n", ret);
-    msleep(500); /* Give extra time for writes to complete */
-    write_debug_marker("UNMOUNT_SDCARD_PRE_SYNC_DONE");
-    
-    /* Try to unmount SD card with retries - using -f (force) then -l (lazy) */
-    printk(KERN_INFO "poweroff_hook: Unmounting /mnt/SDCARD (with retries)\n");
-    write_debug_marker("UNMOUNT_SDCARD_START");
-    for (retry = 0; retry < 3; retry++) {
-        char marker_msg[64];
-        char *argv_umount_force_lazy[] = { "/bin/umount", "-f", "-l", "/mnt/SDCARD", NULL };
-        
-        snprintf(marker_msg, sizeof(marker_msg), "UNMOUNT_SDCARD_ATTEMPT_%d", retry + 1);
-        write_debug_marker(marker_msg);
-        
-        /* Kill any processes still using the SD card */
-        if (retry > 0) {
-            write_debug_marker("UNMOUNT_SDCARD_LSOF_KILL");
-            kill_sdcard_users();
-            msleep(200);
+    char *word;
+    int n;
+
+    *action = ACTION_POWEROFF;
+    *dry = dry_run;
+    while ((word = strsep(&payload, " \t\n")) != NULL) {
+        if (!strcmp(word, "reboot")) {
+            *action = ACTION_REBOOT;
+        } else if (!strcmp(word, "halt")) {
+            *action = ACTION_HALT;
+        } else if (!strcmp(word, "poweroff")) {
+            *action = ACTION_POWEROFF;
+        } else if (!strncmp(word, "dryrun", 6)) {
+            n = DRY_RUN_SAFE;
+            if (word[6] == '=' && kstrtoint(word + 7, 10, &n))
+                n = DRY_RUN_SAFE;
+            *dry = max(*dry, n);
         }
+    }
+    *dry = clamp(*dry, 0, DRY_RUN_NO_CUTOFF);
+}
 
-        /* Try force + lazy unmount together */
-        ret = call_usermodehelper(argv_umount_force_lazy[0], argv_umount_force_lazy, usermode_envp, UMH_WAIT_PROC);
-        printk(KERN_INFO "poweroff_hook: umount -f -l /mnt/SDCARD returned: %d\n", ret);
-        
-        write_debug_marker("UNMOUNT_SDCARD_WAIT_START");
-        msleep(800); /* Wait longer for unmount to complete */
-        write_debug_marker("UNMOUNT_SDCARD_WAIT_DONE");
-        
-        write_debug_marker("UNMOUNT_SDCARD_CHECK_START");
-        if (!is_sdcard_mounted()) {
-            printk(KERN_INFO "poweroff_hook: SD card unmounted successfully after %d attempts\n", retry + 1);
-            write_debug_marker("UNMOUNT_SDCARD_SUCCESS");
-            break;
-        }
-        write_debug_marker("UNMOUNT_SDCARD_STILL_MOUNTED");
-        
-        if (retry < 2) {
-            printk(KERN_WARNING "poweroff_hook: SD card still mounted, retry %d/2\n", retry + 1);
-            /* Force sync before next retry */
-            write_debug_marker("UNMOUNT_SDCARD_RETRY_SYNC");
-            ret = call_usermodehelper(argv_sync[0], argv_sync, usermode_envp, UMH_WAIT_PROC);
-            printk(KERN_INFO "poweroff_hook: retry sync returned: %d\n", ret);
-            msleep(300);
-        }
+static void read_signal_payload(int *action, int *dry)
+{
+    char payload[64];
+
+    if (read_text_file(POWEROFF_SIGNAL_FILE, payload, sizeof(payload)) < 0)
+        payload[0] = '\0';
+    parse_trigger_payload(payload, action, dry);
+}
+
+/* Same payload as the signal file: echo reboot > /proc/poweroff_hook/trigger */
+static ssize_t trigger_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    char payload[64];
+    size_t len = min(count, sizeof(payload) - 1);
+
+    if (copy_from_user(payload, buf, len))
+        return -EFAULT;
+    payload[len] = '\0';
+
+    if (trigger_requested || (current_stage >= 0 && current_stage < NR_SHUTDOWN_STAGES))
+        return -EBUSY;
+    parse_trigger_payload(payload, &trigger_action, &trigger_dry_run);
+    trigger_requested = true;
+    wake_up(&monitor_wq);
+    return count;
+}
+
+static const struct file_operations trigger_fops = {
+    .owner = THIS_MODULE,
+    .write = trigger_write,
+    .llseek = noop_llseek,
+};
+
+/*
+ * /proc/poweroff_hook/wait: each read blocks for the next event of the
+ * current (or next) sequence and returns one line: "stage <name>" per
+ * stage, then "done" (dry run finished), "idle" (no sequence started
+ * within WAIT_START_TIMEOUT_MS) or "unloaded". EOF follows the last line,
+ * so poweroff_next can just cat it. A real sequence has no last line: its
+ * kill stages take the reader with them and it ends in the cutoff.
+ */
+struct wait_reader {
+    unsigned int gen;
+    int last_stage;
+    bool finished;
+};
+
+static bool wait_started(const struct wait_reader *r)
+{
+    return (int)(sequence_gen - r->gen) >= 0;
+}
+
+static bool wait_has_news(const struct wait_reader *r)
+{
+    return wait_unloading || sequence_gen != r->gen || sequence_result != SEQ_RUNNING ||
+           (current_stage != r->last_stage && current_stage >= 0 &&
+            current_stage < NR_SHUTDOWN_STAGES);
+}
+
+static ssize_t wait_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+    struct wait_reader *r = file->private_data;
+    char line[96];
+    long ret;
+    int len;
+
+    if (r->finished)
+        return 0;
+
+    ret = wait_event_interruptible_timeout(progress_wq, wait_started(r) || wait_unloading,
+                                           msecs_to_jiffies(WAIT_START_TIMEOUT_MS));
+    if (ret < 0)
+        return ret;
+    if (ret && !wait_unloading && wait_event_interruptible(progress_wq, wait_has_news(r)))
+        return -ERESTARTSYS;
+
+    if (wait_unloading) {
+        len = scnprintf(line, sizeof(line), "unloaded\n");
+    } else if (!ret) {
+        len = scnprintf(line, sizeof(line), "idle\n");
+    } else if (sequence_gen != r->gen || sequence_result != SEQ_RUNNING) {
+        len = scnprintf(line, sizeof(line), "done\n");
+    } else {
+        r->last_stage = current_stage;
+        len = scnprintf(line, sizeof(line), "stage %s\n", shutdown_stages[r->last_stage].name);
+        goto out;
     }
-    
-    printk(KERN_INFO "poweroff_hook: Final sync\n");
-    write_debug_marker("UNMOUNT_FINAL_SYNC_START");
-    ret = call_usermodehelper(argv_sync[0], argv_sync, usermode_envp, UMH_WAIT_PROC);
-    printk(KERN_INFO "poweroff_hook: final sync returned: %d\n", ret);
-    msleep(200);
-    write_debug_marker("UNMOUNT_FINAL_SYNC_DONE");
+    r->finished = true;
+out:
+    len = min_t(size_t, len, count);
+    if (copy_to_user(buf, line, len))
+        return -EFAULT;
+    return len;
+}
+
+static int wait_open(struct inode *inode, struct file *file)
+{
+    struct wait_reader *r = kzalloc(sizeof(*r), GFP_KERNEL);
+
+    if (!r)
+        return -ENOMEM;
+    /* A reader that arrives before the monitor sees the signal waits for that sequence */
+    r->gen = sequence_result == SEQ_RUNNING ? sequence_gen : sequence_gen + 1;
+    r->last_stage = -1;
+    file->private_data = r;
+    return nonseekable_open(inode, file);
+}
+
+static int wait_release(struct inode *inode, struct file *file)
+{
+    kfree(file->private_data);
+    return 0;
 }
 
+static const struct file_operations wait_fops = {
+    .owner = THIS_MODULE,
+    .open = wait_open,
+    .read = wait_read,
+    .release = wait_release,
+    .llseek = no_llseek,
+};
+
 /*
- * Execute AXP717/AXP2202 PMIC clean poweroff sequence (safe minimal version)
+ * Everything a previous sequence (a dry run) may have left behind: a
+ * dryrun=2 kills, swaps off and stops SD logging just like a real run
  */
-static void execute_axp2202_poweroff(void)
+static void reset_sequence_state(void)
+{
+    user_processes_killed = false;
+    sd_logging_enabled = true;
+    sdcard_dev = 0;
+    shutdown_path = 0;
+    reinit_completion(&swap_reclaim_done);
+}
+
+/*
+ * End of a dry run: drop the deadline, report, remove the signal file and
+ * go back to watching for the next one
+ */
+static void finish_dry_run(void)
 {
+    char *argv_rm[] = { "/bin/rm", "-f", POWEROFF_SIGNAL_FILE, NULL };
+    char marker[128];
     int i, ret;
 
-    printk(KERN_INFO "poweroff_hook: ===== Starting AXP717/AXP2202 Clean Poweroff Sequence =====\n");
-    write_debug_marker("PMIC_SEQUENCE_START");
+    hrtimer_cancel(&deadline_timer);
+    kthread_cancel_work_sync(&deadline_work);
+    set_cpufreq_pin(CPUFREQ_PIN_NONE);
 
-    /* Step 1: Mask interrupts (registers 0x40-0x44 per datasheet) */
-    printk(KERN_INFO "poweroff_hook: Step 1/4 - Masking interrupts (0x40-0x44)\n");
-    write_debug_marker("STEP1_MASK_INTERRUPTS");
-    for (i = 0x40; i <= 0x44; i++) {
-        ret = axp2202_write_reg(i, 0x00);
-        if (ret < 0)
-            printk(KERN_INFO "poweroff_hook: Failed to mask IRQ reg 0x%02x, error=%d\n", i, ret);
+    for (i = 0; i < NR_SHUTDOWN_STAGES; i++) {
+        const struct shutdown_stage *st = &shutdown_stages[i];
+
+        printk(KERN_INFO "poweroff_hook: dry run: %-18s %-11s ret=%d attempts=%d time=%lldms\n",
+               st->name, outcome_names[st->outcome], st->ret, st->attempts, st->elapsed_ms);
     }
+    snprintf(marker, sizeof(marker), "DRY_RUN_DONE level=%d total=%lldms",
+             active_dry_run, ktime_to_ms(ktime_sub(ktime_get(), signal_time)));
+    write_debug_marker(marker);
+
+    ret = run_helper(argv_rm, helper_timeout_ms);
+    if (ret)
+        printk(KERN_WARNING "poweroff_hook: Could not remove %s after dry run: %d\n",
+               POWEROFF_SIGNAL_FILE, ret);
+    active_dry_run = 0;
+    reset_sequence_state();
+}
 
-    /* Step 2: Clear interrupt status flags (registers 0x48-0x4C per datasheet) */
-    printk(KERN_INFO "poweroff_hook: Step 2/4 - Clearing interrupt status (0x48-0x4C)\n");
-    write_debug_marker("STEP2_CLEAR_IRQ_STATUS");
-    for (i = 0x48; i <= 0x4C; i++) {
-        ret = axp2202_write_reg(i, 0xFF);
-        if (ret < 0)
-            printk(KERN_INFO "poweroff_hook: Failed to clear IRQ status reg 0x%02x, error=%d\n", i, ret);
+/*
+ * From the signal on, run the shutdown thread SCHED_FIFO (and optionally
+ * on one CPU) so busy userspace cannot delay the stages that stop it
+ */
+static void boost_shutdown_thread(void)
+{
+    struct sched_param param = {
+        .sched_priority = clamp(shutdown_rt_priority, 0, SHUTDOWN_RT_PRIO_MAX),
+    };
+    char marker[64];
+    int ret = 0;
+
+    if (param.sched_priority > 0) {
+        ret = sched_setscheduler(current, SCHED_FIFO, &param);
+        rt_boosted = !ret;
     }
+    if (shutdown_cpu >= 0 && shutdown_cpu < nr_cpu_ids && cpu_online(shutdown_cpu))
+        set_cpus_allowed_ptr(current, cpumask_of(shutdown_cpu));
 
-    /* Step 3: Configure shutdown sources (0x22 = PWROFF_EN) */
-    /* Bit 3: LDO Over-Current as poweroff source enable */
-    /* Bit 1: PWRON > OFFLEVEL as poweroff source enable */
-    /* Bit 0: Function select (0=poweroff, 1=restart) when button event occurs */
-    printk(KERN_INFO "poweroff_hook: Step 3/4 - Configuring shutdown sources (0x22)\n");
-    write_debug_marker("STEP3_SHUTDOWN_SOURCES");
-    axp2202_write_reg(0x22, 0x0A);  /* 0b00001010 - set bits 1,3 only */
-    msleep(50);
+    snprintf(marker, sizeof(marker), "SHUTDOWN_RT prio=%d cpu=%d ret=%d",
+             rt_boosted ? param.sched_priority : 0, shutdown_cpu, ret);
+    write_debug_marker(marker);
+}
 
-    /* Step 4: TRIGGER SOFTWARE POWER-OFF (Register 0x27, bit 0 = 0x01) */
-    /* This is the software poweroff command on AXP717/AXP2202 */
-    printk(KERN_INFO "poweroff_hook: Step 4/4 - TRIGGERING SOFTWARE POWER-OFF (0x27)\n");
-    write_debug_marker("STEP4_TRIGGER_POWEROFF");
-    ret = axp2202_write_reg(0x27, 0x01);
-    if (ret < 0)
-        printk(KERN_INFO "poweroff_hook: CRITICAL - PMIC poweroff trigger failed! error=%d\n", ret);
-    else
-        printk(KERN_INFO "poweroff_hook: PMIC SOFTWARE POWER-OFF TRIGGERED (0x27=0x01)\n");
-    write_debug_marker("STEP4_COMPLETE");
-    
-    /* Power should cut almost immediately after this command.
-     * If we reach here, give PMIC a moment to latch the shutdown. */
-    msleep(1000);
+/* Back to normal scheduling once a dry run is over */
+static void unboost_shutdown_thread(void)
+{
+    struct sched_param param = { .sched_priority = 0 };
 
-    printk(KERN_INFO "poweroff_hook: ===== AXP717/AXP2202 Poweroff Sequence Complete =====\n");
-    write_debug_marker("PMIC_SEQUENCE_COMPLETE");
+    rt_boosted = false;
+    sched_setscheduler(current, SCHED_NORMAL, &param);
+    set_cpus_allowed_ptr(current, cpu_possible_mask);
 }
 
 /*
@@ -391,9 +3605,6 @@ static void execute_axp2202_poweroff(void)
 static int monitor_thread_fn(void *data)
 {
     struct file *filp;
-    struct timespec ts;
-    struct tm tm;
-    char log_msg[256];
     static int check_count = 0;
 
     printk(KERN_INFO "poweroff_hook: Monitor thread started\n");
@@ -408,72 +3619,47 @@ static int monitor_thread_fn(void *data)
         
         /* Check for signal file - simple file existence check */
         filp = filp_open(POWEROFF_SIGNAL_FILE, O_RDONLY, 0);
-        if (!IS_ERR(filp)) {
-            filp_close(filp, NULL);
-            
-            write_debug_marker("SIGNAL_DETECTED");
-            printk(KERN_INFO "poweroff_hook: *** SIGNAL FILE DETECTED! ***\n");
-            
-            /* Get timestamp for logging */
-            getnstimeofday(&ts);
-            time_to_tm(ts.tv_sec, 0, &tm);
-            
-            snprintf(log_msg, sizeof(log_msg),
-                     "=== PowerOff Signal Received ===\n"
-                     "Timestamp: %04ld-%02d-%02d %02d:%02d:%02d UTC\n",
-                     tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
-                     tm.tm_hour, tm.tm_min, tm.tm_sec);
-            
-            write_log(log_msg);
-            write_debug_marker("BEFORE_KILL_SDCARD_PROCESSES");
-            msleep(500);
-            printk(KERN_INFO "poweroff_hook: ============================================\n");
-            printk(KERN_INFO "poweroff_hook: PowerOff signal received from NextUI\n");
-            printk(KERN_INFO "poweroff_hook: Beginning clean shutdown sequence\n");
-            printk(KERN_INFO "poweroff_hook: ============================================\n");
-
-            /* Step 1: Kill all processes that use the SD card */
-            kill_sdcard_users();
-            write_debug_marker("AFTER_KILL_SDCARD_PROCESSES");
-            
-            /* Step 2: Disable swap and unmount filesystems */
-            write_debug_marker("BEFORE_UNMOUNT");
-            unmount_filesystems();
-            write_debug_marker("AFTER_UNMOUNT");
+        if (!IS_ERR(filp) || battery_critical || trigger_requested) {
+            char marker[64];
+
+            if (!IS_ERR(filp))
+                filp_close(filp, NULL);
             
-            /* Verify SD card is unmounted */
-            if (is_sdcard_mounted()) {
-                printk(KERN_ERR "poweroff_hook: CRITICAL - SD card still mounted after 5 attempts!\n");
-                printk(KERN_ERR "poweroff_hook: Skipping PMIC sequence, calling kernel poweroff directly\n");
-                write_debug_marker("SD_STILL_MOUNTED_EMERGENCY");
-                
-                /* Skip PMIC shutdown and go straight to kernel poweroff for safety */
-                printk(KERN_INFO "poweroff_hook: Calling kernel_power_off() (emergency path)\n");
-                write_debug_marker("EMERGENCY_KERNEL_POWEROFF");
-                msleep(500);
-                kill_all_processes();
-                kernel_power_off();
-                
-                /* Should never reach here */
-                printk(KERN_INFO "poweroff_hook: kernel_power_off() returned, halting\n");
-                while (1) {
-                    cpu_relax();
-                }
+            reset_sequence_state();
+            if (battery_critical) {
+                write_debug_marker("SIGNAL_BATTERY_CRITICAL");
+                shutdown_path |= HISTORY_BATTERY;
+                shutdown_action = ACTION_POWEROFF;
+                active_dry_run = 0;
+            } else if (trigger_requested) {
+                write_debug_marker("SIGNAL_PROC_TRIGGER");
+                shutdown_path |= HISTORY_PROC_TRIGGER;
+                shutdown_action = trigger_action;
+                active_dry_run = trigger_dry_run;
             } else {
-                printk(KERN_INFO "poweroff_hook: SD card successfully unmounted\n");
-                write_debug_marker("SD_UNMOUNTED_OK");
+                write_debug_marker("SIGNAL_DETECTED");
+                read_signal_payload(&shutdown_action, &active_dry_run);
+            }
+            trigger_requested = false;
+            printk(KERN_INFO "poweroff_hook: *** SIGNAL FILE DETECTED! ***\n");
+            snprintf(marker, sizeof(marker), "SHUTDOWN_ACTION %s dry_run=%d",
+                     action_names[shutdown_action], active_dry_run);
+            write_debug_marker(marker);
+            boost_shutdown_thread();
+            signal_time = ktime_get();
+            arm_shutdown_deadline(shutdown_budget_ms);
+            sequence_gen++;
+            publish_progress(SEQ_RUNNING);
+
+            run_shutdown_stages();
+
+            if (active_dry_run) {
+                finish_dry_run();
+                unboost_shutdown_thread();
+                publish_progress(SEQ_DONE);
+                continue;
             }
 
-            /* Step 3: Kill all user processes (but not kernel threads) */
-            write_debug_marker("BEFORE_KILL_ALL_PROCESSES");
-            kill_all_processes();
-            write_debug_marker("AFTER_KILL_ALL_PROCESSES");
-
-            /* Step 4: Execute PMIC shutdown sequence */
-            write_debug_marker("BEFORE_PMIC_SHUTDOWN");
-            msleep(500);
-            execute_axp2202_poweroff();
-            write_debug_marker("AFTER_PMIC_SHUTDOWN");
             
             /* Call kernel poweroff */
             printk(KERN_INFO "poweroff_hook: Calling kernel_power_off()\n");
@@ -488,8 +3674,10 @@ static int monitor_thread_fn(void *data)
             }
         }
 
-        /* Sleep for 100ms before checking again */
-        msleep(100);
+        /* Sleep for 100ms before checking again, or until the battery handler wakes us */
+        wait_event_interruptible_timeout(monitor_wq,
+                                         battery_critical || trigger_requested || kthread_should_stop(),
+                                         msecs_to_jiffies(100));
     }
 
     printk(KERN_INFO "poweroff_hook: Monitor thread exiting\n");
@@ -514,13 +3702,41 @@ static int __init poweroff_hook_init(void)
     printk(KERN_INFO "poweroff_hook: Purpose: Clean AXP717/AXP2202 PMIC shutdown sequence\n");
 
     /* Get I2C adapter for AXP717/AXP2202 communication */
-    i2c_adapter = i2c_get_adapter(I2C_BUS_NUMBER);
+    i2c_adapter = i2c_get_adapter(i2c_bus);
     if (!i2c_adapter) {
-        printk(KERN_ERR "poweroff_hook: Failed to get I2C adapter %d\n", I2C_BUS_NUMBER);
+        printk(KERN_ERR "poweroff_hook: Failed to get I2C adapter %d\n", i2c_bus);
         return -ENODEV;
     }
     printk(KERN_INFO "poweroff_hook: I2C adapter %d acquired for AXP717/AXP2202 (addr 0x%02x)\n",
-           I2C_BUS_NUMBER, AXP2202_I2C_ADDR);
+           i2c_bus, pmic_addr);
+
+    pmic_regmap = regmap_init(NULL, &axp2202_regmap_bus, NULL, &axp2202_regmap_config);
+    if (IS_ERR(pmic_regmap)) {
+        printk(KERN_ERR "poweroff_hook: Failed to create PMIC regmap: %ld\n", PTR_ERR(pmic_regmap));
+        i2c_put_adapter(i2c_adapter);
+        i2c_adapter = NULL;
+        return PTR_ERR(pmic_regmap);
+    }
+
+    pmic_variant = probe_pmic_variant();
+    map_twi_controller();
+
+    /* Prime the cache for verified registers now so the shutdown path can skip redundant writes */
+    {
+        unsigned int value;
+        int i, j;
+
+        for (i = 0; pmic_variant && i < pmic_variant->nsteps; i++) {
+            const struct pmic_step *step = &pmic_variant->steps[i];
+
+            if (step->write != axp2202_write_verified)
+                continue;
+            for (j = 0; j < step->count; j++) {
+                if (regmap_read(pmic_regmap, step->reg + j, &value) == 0)
+                    printk(KERN_INFO "poweroff_hook: PMIC reg 0x%02x = 0x%02x\n", step->reg + j, value);
+            }
+        }
+    }
 
     /* DO NOT touch register 0x27 during init!
      * Register 0x27 bit 0 (0x01) is the SOFTWARE POWER-OFF TRIGGER.
@@ -558,7 +3774,7 @@ static int __init poweroff_hook_init(void)
              "I2C Bus: %d, PMIC Address: 0x%02x\n\n",
              tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
              tm.tm_hour, tm.tm_min, tm.tm_sec,
-             POWEROFF_SIGNAL_FILE, I2C_BUS_NUMBER, AXP2202_I2C_ADDR);
+             POWEROFF_SIGNAL_FILE, i2c_bus, pmic_addr);
     write_log(log_msg);
 
     /* Append content from /root/poweroff_hook.log to the main log file
@@ -608,15 +3824,90 @@ static int __init poweroff_hook_init(void)
         set_fs(old_fs_copy);
     }
 
+    /* Boot-side battery sample lands right after the previous shutdown's markers */
+    format_battery_sample("BOOT", log_msg, sizeof(log_msg) - 2);
+    strcat(log_msg, "\n\n");
+    write_log(log_msg);
+    printk(KERN_INFO "poweroff_hook: %s", log_msg);
+    report_shutdown_history();
+
+    hrtimer_init(&deadline_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    deadline_timer.function = shutdown_deadline_fn;
+    kthread_init_work(&deadline_work, shutdown_deadline_work_fn);
+    INIT_WORK(&battery_work, battery_work_fn);
+
+    /* Deadline worker, SCHED_FIFO above everything the sequence runs at */
+    deadline_worker = kthread_create_worker(0, "poweroff_deadline");
+    if (IS_ERR(deadline_worker)) {
+        printk(KERN_ERR "poweroff_hook: Failed to create deadline worker\n");
+        if (twi_base)
+            iounmap(twi_base);
+        twi_base = NULL;
+        regmap_exit(pmic_regmap);
+        pmic_regmap = NULL;
+        i2c_put_adapter(i2c_adapter);
+        i2c_adapter = NULL;
+        return PTR_ERR(deadline_worker);
+    }
+    {
+        struct sched_param param = { .sched_priority = DEADLINE_RT_PRIO };
+
+        sched_setscheduler(deadline_worker->task, SCHED_FIFO, &param);
+    }
+
+    helper_wq = alloc_workqueue("poweroff_helper", WQ_UNBOUND, 0);
+    if (!helper_wq) {
+        printk(KERN_ERR "poweroff_hook: Failed to create helper workqueue\n");
+        kthread_destroy_worker(deadline_worker);
+        deadline_worker = NULL;
+        if (twi_base)
+            iounmap(twi_base);
+        twi_base = NULL;
+        regmap_exit(pmic_regmap);
+        pmic_regmap = NULL;
+        i2c_put_adapter(i2c_adapter);
+        i2c_adapter = NULL;
+        return -ENOMEM;
+    }
+
     /* Start monitor thread */
     monitor_thread = kthread_run(monitor_thread_fn, NULL, "poweroff_monitor");
     if (IS_ERR(monitor_thread)) {
         printk(KERN_ERR "poweroff_hook: Failed to create monitor thread\n");
+        destroy_workqueue(helper_wq);
+        helper_wq = NULL;
+        kthread_destroy_worker(deadline_worker);
+        deadline_worker = NULL;
+        if (twi_base)
+            iounmap(twi_base);
+        twi_base = NULL;
+        regmap_exit(pmic_regmap);
+        pmic_regmap = NULL;
         i2c_put_adapter(i2c_adapter);
         i2c_adapter = NULL;
         return PTR_ERR(monitor_thread);
     }
 
+    proc_dir = proc_mkdir("poweroff_hook", NULL);
+    if (!proc_dir || !proc_create("status", 0444, proc_dir, &status_fops) ||
+        !proc_create("trigger", 0200, proc_dir, &trigger_fops) ||
+        !proc_create("wait", 0444, proc_dir, &wait_fops))
+        printk(KERN_WARNING "poweroff_hook: Could not create /proc/poweroff_hook entries\n");
+
+    atomic_notifier_chain_register(&panic_notifier_list, &panic_nb);
+    register_die_notifier(&die_nb);
+    power_supply_reg_notifier(&psy_nb);
+    if (cpufreq_register_notifier(&cpufreq_nb, CPUFREQ_POLICY_NOTIFIER))
+        printk(KERN_WARNING "poweroff_hook: Could not register cpufreq notifier, no per-stage frequency\n");
+    if (kmsg_dump_register(&panic_dumper))
+        printk(KERN_WARNING "poweroff_hook: Could not register panic dumper, no PMIC cutoff on panic\n");
+
+    if (hook_pm_power_off) {
+        prev_pm_power_off = pm_power_off;
+        pm_power_off = poweroff_hook_pm_power_off;
+        printk(KERN_INFO "poweroff_hook: Installed atomic PMIC cutoff as pm_power_off\n");
+    }
+
     printk(KERN_INFO "poweroff_hook: Monitor thread started, watching for %s\n", POWEROFF_SIGNAL_FILE);
     printk(KERN_INFO "poweroff_hook: ============================================\n");
 
@@ -630,12 +3921,49 @@ static void __exit poweroff_hook_exit(void)
 {
     printk(KERN_INFO "poweroff_hook: Unloading module\n");
 
+    if (pm_power_off == poweroff_hook_pm_power_off)
+        pm_power_off = prev_pm_power_off;
+
+    /* Blocked wait readers would hold up the proc removal */
+    wait_unloading = true;
+    wake_up_all(&progress_wq);
+    remove_proc_subtree("poweroff_hook", NULL);
+    kmsg_dump_unregister(&panic_dumper);
+    power_supply_unreg_notifier(&psy_nb);
+    cpufreq_unregister_notifier(&cpufreq_nb, CPUFREQ_POLICY_NOTIFIER);
+    cancel_work_sync(&battery_work);
+    unregister_die_notifier(&die_nb);
+    atomic_notifier_chain_unregister(&panic_notifier_list, &panic_nb);
+
     /* Stop monitor thread */
     if (monitor_thread) {
         should_stop = true;
         kthread_stop(monitor_thread);
         monitor_thread = NULL;
     }
+    set_cpufreq_pin(CPUFREQ_PIN_NONE);
+
+    hrtimer_cancel(&deadline_timer);
+    kthread_cancel_work_sync(&deadline_work);
+    kthread_destroy_worker(deadline_worker);
+    deadline_worker = NULL;
+
+    /* Blocks until every abandoned helper has returned from the module */
+    if (atomic_read(&helpers_outstanding))
+        printk(KERN_WARNING "poweroff_hook: Waiting for %d outstanding helper(s) before unloading\n",
+               atomic_read(&helpers_outstanding));
+    destroy_workqueue(helper_wq);
+    helper_wq = NULL;
+
+    if (twi_base) {
+        iounmap(twi_base);
+        twi_base = NULL;
+    }
+
+    if (pmic_regmap) {
+        regmap_exit(pmic_regmap);
+        pmic_regmap = NULL;
+    }
 
     /* Release I2C adapter */
     if (i2c_adapter) {